@@ -0,0 +1,189 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_INTERVAL_DUMP_H
+#define REGISTER_ALLOCATOR_MINIMAL_INTERVAL_DUMP_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "cstdint"
+#include "cstring"
+
+/*
+Columnar binary dump of the live intervals of one function, written by the Minimal
+Register Allocator with -regalloc-minimal-dump-dir and read by regalloc-query.
+
+The file is meant to be memory mapped and used in place, without parsing:
+
+    FileHeader
+    column 0:   uint32_t[NumRows]
+    ...
+    column N-1: uint32_t[NumRows]
+    segments:   Segment[NumSegments]
+    strings:    NUL terminated strings, referenced by offset
+
+Every column has 4 byte elements, Weight and WeightedReloads hold the bits of a
+float. All sections start at an 8 byte aligned offset. Numbers are stored in the
+byte order of the machine that wrote the file.
+
+There is one row per virtual register the allocator dequeued, including the ones
+that were later spilled and no longer exist once allocation is done.
+*/
+namespace llvm {
+namespace IntervalDump {
+
+constexpr char Magic[8] = {'R', 'A', 'I', 'D', 'U', 'M', 'P', '1'};
+constexpr uint32_t Version = 1;
+
+// Slot index units per instruction, SlotIndex::InstrDist
+constexpr uint32_t SlotsPerInstruction = 16;
+
+enum Column : unsigned {
+    VirtReg,            // Virtual register index
+    OriginalReg,        // Index of the register it was split or spilled from
+    RegClassName,       // String offset
+    Weight,             // float, spill weight when last dequeued
+    PhysRegName,        // String offset of the assigned register, 0 if none
+    StackSlot,          // int32_t, stack slot of the original register, -1 if none
+    History,            // HistoryFlags
+    Dequeues,           // Number of times the register was dequeued
+    WeightedReloads,    // float, block frequency weighted uses at the time of spilling
+    SegmentBegin,       // First segment of the row
+    SegmentCount,       // Number of segments of the row
+    NumColumns
+};
+
+enum HistoryFlags : uint32_t {
+    Assigned = 1 << 0,
+    Evicted = 1 << 1,
+    Spilled = 1 << 2,
+    SplitProduct = 1 << 3
+};
+
+// Live segment, in slot index units from the start of the function.
+struct Segment {
+    uint32_t Start;
+    uint32_t End;
+};
+
+struct FileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NumRows;
+    uint32_t NumSegments;
+    uint32_t FunctionName;
+    uint64_t ColumnOffset[NumColumns];
+    uint64_t SegmentOffset;
+    uint64_t StringTableOffset;
+    uint64_t StringTableSize;
+};
+
+/*
+Read-only view of a dump file. All accessors point into the mapped buffer.
+*/
+class FileView {
+private:
+    const char *Data;
+    const FileHeader *Header;
+
+    FileView(const char *Data) : Data(Data), Header(reinterpret_cast<const FileHeader *>(Data)) {}
+
+public:
+    static Expected<FileView> create(MemoryBufferRef Buffer) {
+        StringRef Bytes = Buffer.getBuffer();
+        const FileHeader *Header = reinterpret_cast<const FileHeader *>(Bytes.data());
+        if(Bytes.size() < sizeof(FileHeader) || std::memcmp(Header->Magic, Magic, sizeof(Magic)) != 0) {
+            return createStringError(inconvertibleErrorCode(), "%s: not an interval dump",
+                                     Buffer.getBufferIdentifier().str().c_str());
+        }
+        if(Header->Version != Version) {
+            return createStringError(inconvertibleErrorCode(), "%s: unsupported interval dump version %u",
+                                     Buffer.getBufferIdentifier().str().c_str(), Header->Version);
+        }
+
+        /*
+        Offsets and sizes come from the file. Compared without adding them, so
+        that huge values cannot wrap around, and the sections read in place have
+        to be aligned for their element type.
+        */
+        uint64_t Size = Bytes.size();
+        auto inBounds = [Size](uint64_t Offset, uint64_t Length) {
+            return Offset <= Size && Length <= Size - Offset;
+        };
+        uint64_t RowBytes = uint64_t(Header->NumRows) * sizeof(uint32_t);
+        bool InBounds = inBounds(Header->SegmentOffset, uint64_t(Header->NumSegments) * sizeof(Segment))
+                        && inBounds(Header->StringTableOffset, Header->StringTableSize);
+        bool Aligned = reinterpret_cast<uintptr_t>(Bytes.data()) % alignof(FileHeader) == 0
+                       && Header->SegmentOffset % alignof(Segment) == 0;
+        for(unsigned Col = 0; Col < NumColumns; Col++) {
+            InBounds &= inBounds(Header->ColumnOffset[Col], RowBytes);
+            Aligned &= Header->ColumnOffset[Col] % alignof(uint32_t) == 0;
+        }
+        if(!InBounds) {
+            return createStringError(inconvertibleErrorCode(), "%s: truncated interval dump",
+                                     Buffer.getBufferIdentifier().str().c_str());
+        }
+        if(!Aligned) {
+            return createStringError(inconvertibleErrorCode(), "%s: misaligned interval dump section",
+                                     Buffer.getBufferIdentifier().str().c_str());
+        }
+        // getString reads up to the NUL, the last string must not run off the table.
+        if(Header->StringTableSize && Bytes[Header->StringTableOffset + Header->StringTableSize - 1] != '\0') {
+            return createStringError(inconvertibleErrorCode(), "%s: unterminated interval dump string table",
+                                     Buffer.getBufferIdentifier().str().c_str());
+        }
+
+        // Readers index segments() with these without further checks.
+        FileView View(Bytes.data());
+        for(uint32_t Row = 0; Row < Header->NumRows; Row++) {
+            uint64_t SegmentEnd = uint64_t(View.get(SegmentBegin, Row)) + View.get(SegmentCount, Row);
+            if(SegmentEnd > Header->NumSegments) {
+                return createStringError(inconvertibleErrorCode(),
+                                         "%s: row %u references segments up to %llu, the dump has %u",
+                                         Buffer.getBufferIdentifier().str().c_str(), Row,
+                                         (unsigned long long)SegmentEnd, Header->NumSegments);
+            }
+        }
+
+        return View;
+    }
+
+    uint32_t getNumRows() const {
+        return Header->NumRows;
+    }
+
+    const uint32_t *column(Column Col) const {
+        return reinterpret_cast<const uint32_t *>(Data + Header->ColumnOffset[Col]);
+    }
+
+    uint32_t get(Column Col, uint32_t Row) const {
+        return column(Col)[Row];
+    }
+
+    float getFloat(Column Col, uint32_t Row) const {
+        uint32_t Bits = get(Col, Row);
+        float Value;
+        std::memcpy(&Value, &Bits, sizeof(Value));
+        return Value;
+    }
+
+    const Segment *segments() const {
+        return reinterpret_cast<const Segment *>(Data + Header->SegmentOffset);
+    }
+
+    StringRef getString(uint32_t Offset) const {
+        if(Offset >= Header->StringTableSize) {
+            return StringRef();
+        }
+        StringRef Table(Data + Header->StringTableOffset, Header->StringTableSize);
+        return Table.drop_front(Offset).take_until([](char C) { return C == '\0'; });
+    }
+
+    StringRef getFunctionName() const {
+        return getString(Header->FunctionName);
+    }
+};
+
+}
+}
+
+#endif
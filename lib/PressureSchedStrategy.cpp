@@ -0,0 +1,84 @@
+#include <llvm/CodeGen/MachineScheduler.h>
+#include <llvm/CodeGen/RegisterPressure.h>
+
+using namespace llvm;
+
+namespace {
+
+/*
+Pre-RA machine scheduling strategy that puts register pressure before latency
+whenever a scheduling region would not fit in the register file.
+
+The generic scheduler happily hoists long latency instructions and groups loads
+to hide latency. That lengthens live ranges, and when the region is already at the
+register limit those extra live ranges come back as spills in the allocator.
+
+Pressure is tracked per register pressure set (the register class view the
+scheduler works with) by the RegPressureTracker of ScheduleDAGMILive:
+    - After the DAG of a region is built, ScheduleDAGMILive records every pressure
+      set whose maximum pressure exceeds its limit (getRegionCriticalPSets).
+    - If there is any, candidates are compared on pressure first: the excess over
+      the limit, then the critical sets, then the overall maximum. Only when
+      pressure is equal does the generic latency and resource heuristic decide.
+    - Regions that fit keep the generic behaviour, latency is free to win there.
+*/
+class PressureSchedStrategy: public GenericScheduler {
+private:
+    // Set when the current region exceeds the register limit of some pressure set
+    bool RegionExceedsLimit = false;
+
+public:
+    PressureSchedStrategy(const MachineSchedContext *C) : GenericScheduler(C) {}
+
+    void initPolicy(MachineBasicBlock::iterator Begin, MachineBasicBlock::iterator End,
+                    unsigned NumRegionInstrs) override {
+        GenericScheduler::initPolicy(Begin, End, NumRegionInstrs);
+
+        // The whole strategy depends on per-instruction pressure deltas.
+        RegionPolicy.ShouldTrackPressure = true;
+    }
+
+    void registerRoots() override {
+        GenericScheduler::registerRoots();
+        RegionExceedsLimit = DAG->isTrackingPressure() && !DAG->getRegionCriticalPSets().empty();
+    }
+
+protected:
+    bool tryCandidate(SchedCandidate &Cand, SchedCandidate &TryCand, SchedBoundary *Zone) const override {
+        if(!RegionExceedsLimit || !Cand.isValid()) {
+            return GenericScheduler::tryCandidate(Cand, TryCand, Zone);
+        }
+
+        // Over the limit: reduce pressure, whatever the latency cost.
+        if(tryPressure(TryCand.RPDelta.Excess, Cand.RPDelta.Excess, TryCand, Cand, RegExcess, TRI, DAG->MF)) {
+            return TryCand.Reason != NoCand;
+        }
+        if(tryPressure(TryCand.RPDelta.CriticalMax, Cand.RPDelta.CriticalMax, TryCand, Cand, RegCritical, TRI,
+                       DAG->MF)) {
+            return TryCand.Reason != NoCand;
+        }
+        if(tryPressure(TryCand.RPDelta.CurrentMax, Cand.RPDelta.CurrentMax, TryCand, Cand, RegMax, TRI,
+                       DAG->MF)) {
+            return TryCand.Reason != NoCand;
+        }
+
+        return GenericScheduler::tryCandidate(Cand, TryCand, Zone);
+    }
+};
+
+ScheduleDAGInstrs *createPressureSched(MachineSchedContext *C) {
+    ScheduleDAGMILive *DAG = new ScheduleDAGMILive(C, std::make_unique<PressureSchedStrategy>(C));
+    // Same mutation as the generic live scheduler, it lets the allocator coalesce copies.
+    DAG->addMutation(createCopyConstrainDAGMutation(DAG->TII, DAG->TRI));
+    return DAG;
+}
+
+/*
+Register the strategy next to the allocator.
+
+llc -misched=register-pressure-minimal -regalloc=register-allocator-minimal input.bc
+*/
+static MachineSchedRegistry PressureSchedRegistry("register-pressure-minimal",
+                                                  "Register pressure first scheduling before allocation",
+                                                  createPressureSched);
+}
@@ -1,23 +1,175 @@
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/CodeGen/CalcSpillWeights.h>
 #include <llvm/CodeGen/LiveIntervals.h>
 #include <llvm/CodeGen/LiveRangeEdit.h>
 #include <llvm/CodeGen/LiveRegMatrix.h>
 #include <llvm/CodeGen/LiveStacks.h>
 #include <llvm/CodeGen/MachineBlockFrequencyInfo.h>
 #include <llvm/CodeGen/MachineDominators.h>
+#include <llvm/CodeGen/MachineFrameInfo.h>
 #include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/MachineInstrBuilder.h>
 #include <llvm/CodeGen/MachineLoopInfo.h>
+#include <llvm/CodeGen/PseudoSourceValue.h>
 #include <llvm/CodeGen/RegAllocRegistry.h>
 #include <llvm/CodeGen/RegisterClassInfo.h>
 #include <llvm/CodeGen/Spiller.h>
+#include <llvm/CodeGen/TargetInstrInfo.h>
+#include <llvm/CodeGen/TargetLowering.h>
+#include <llvm/CodeGen/TargetSchedule.h>
 #include <llvm/CodeGen/VirtRegMap.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/InitializePasses.h>
+#include <llvm/Support/Alignment.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/GraphWriter.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
-
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Support/xxhash.h>
+
+#include "IntervalDump.h"
+#include "RegisterAllocator.h"
+#include "RegisterFileKernel.h"
+
+#include "algorithm"
+#include "chrono"
+#include "climits"
+#include "cstring"
+#include "map"
+#include "mutex"
 #include "queue"
+#include "string"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "regallominimal"
+
+STATISTIC(NumPackedSpillGroups, "Number of scalar spill groups stored with one vector store");
+STATISTIC(NumPackedSpillStores, "Number of scalar spill stores removed by spill packing");
+STATISTIC(NumRequeues, "Number of virtual registers enqueued again after a split or spill");
+
+/*
+The allocation trace is opt-in. With parallel code generation (ThinLTO backends,
+-parallel-codegen) many instances of the allocator run at once, and unconditional
+writes to outs() from all of them interleave and race on the stream buffer.
+*/
+static cl::opt<bool> TraceAllocation(
+    "regalloc-minimal-trace",
+    cl::desc("Print the allocation trace of the Minimal Register Allocator"),
+    cl::init(false), cl::Hidden);
+
+/*
+Serializes the per-function trace flushes to outs(). This is the only piece of
+state shared between allocator instances, and it is only touched when a function
+has a trace or a report to print.
+*/
+static std::mutex TraceOutputMutex;
+
+static cl::opt<bool> ReportChurn(
+    "regalloc-minimal-churn-stats",
+    cl::desc("Report percentiles of interval sizes, interference degree, queue depth "
+             "and requeues per virtual register for every function"),
+    cl::init(false), cl::Hidden);
+
+static cl::opt<std::string> IntervalDumpDir(
+    "regalloc-minimal-dump-dir",
+    cl::desc("Write a columnar dump of the live intervals and assignments of every function "
+             "to this directory (see IntervalDump.h, read with regalloc-query)"),
+    cl::init(""), cl::Hidden);
+
+enum class GraphFormat { None, DOT, GraphML };
+
+static cl::opt<GraphFormat> ExportInterferenceGraph(
+    "regalloc-minimal-export-graph",
+    cl::desc("Export the interference graph of every function"),
+    cl::init(GraphFormat::None),
+    cl::values(clEnumValN(GraphFormat::None, "none", "Do not export"),
+               clEnumValN(GraphFormat::DOT, "dot", "Graphviz DOT"),
+               clEnumValN(GraphFormat::GraphML, "graphml", "GraphML")),
+    cl::Hidden);
+
+static cl::opt<std::string> InterferenceGraphDir(
+    "regalloc-minimal-graph-dir",
+    cl::desc("Directory the interference graphs are written to"),
+    cl::init("."), cl::Hidden);
+
+static cl::opt<bool> InterferenceGraphHottestLoop(
+    "regalloc-minimal-graph-hottest-loop",
+    cl::desc("Restrict the exported interference graph to the loop with the highest block frequency"),
+    cl::init(false), cl::Hidden);
+
+static cl::opt<bool> SpillPacking(
+    "regalloc-minimal-spill-packing",
+    cl::desc("Store groups of nearby scalar FP spills with one vector store (x86-64)"),
+    cl::init(false), cl::Hidden);
+
+static cl::opt<unsigned> SpillPackingWindow(
+    "regalloc-minimal-spill-packing-window",
+    cl::desc("Maximum number of instructions between two spills of one packing group"),
+    cl::init(4), cl::Hidden);
+
+static cl::opt<bool> GenericUnitKernel(
+    "regalloc-minimal-generic-unit-kernel",
+    cl::desc("Use the dynamically sized register unit occupancy kernel on every target "
+             "(see RegisterFileKernel.h)"),
+    cl::init(false), cl::Hidden);
+
+static cl::opt<RegAllocMinimalOrder> AllocationOrder(
+    "regalloc-minimal-order",
+    cl::desc("Order in which virtual registers are allocated"),
+    cl::init(RegAllocMinimalOrder::BlockSpan),
+    cl::values(clEnumValN(RegAllocMinimalOrder::BlockSpan, "span", "Longest block span first"),
+               clEnumValN(RegAllocMinimalOrder::LoopNest, "loop-nest",
+                          "Innermost, hottest loops first, split at loop preheaders")),
+    cl::Hidden);
+
+static cl::opt<unsigned> LocalSplitGap(
+    "regalloc-minimal-local-split-gap",
+    cl::desc("Split an interval local to one block at a stretch of at least this many "
+             "instructions without references to it, instead of spilling it (0 disables)"),
+    cl::init(64), cl::Hidden);
+
+static cl::opt<bool> NextUseEviction(
+    "regalloc-minimal-next-use-eviction",
+    cl::desc("Pick eviction victims among block-local intervals by furthest next use, "
+             "in both tiers"),
+    cl::init(true), cl::Hidden);
+
+static cl::opt<bool> AvoidFalseDependencies(
+    "regalloc-minimal-avoid-false-deps",
+    cl::desc("Keep destinations with a false dependency on their previous value away from "
+             "registers written shortly before, in hot blocks"),
+    cl::init(true), cl::Hidden);
+
+static cl::opt<double> FalseDependencyMinFrequency(
+    "regalloc-minimal-false-dep-min-freq",
+    cl::desc("Block frequency, relative to the entry, from which false dependencies are avoided"),
+    cl::init(4.0), cl::Hidden);
+
+static cl::opt<double> ColdBlockFrequency(
+    "regalloc-minimal-cold-block-freq",
+    cl::desc("Block frequency, relative to the entry, below which a block is off the hot path"),
+    cl::init(0.2), cl::Hidden);
+
+static cl::opt<bool> HotPathCallerSaved(
+    "regalloc-minimal-hot-caller-saved",
+    cl::desc("Keep intervals on the hot path off callee-saved registers the hot path does not "
+             "use already, so their saves can be shrink-wrapped into the cold path"),
+    cl::init(true), cl::Hidden);
+
+static cl::opt<bool> HotColdSplit(
+    "regalloc-minimal-hot-cold-split",
+    cl::desc("Split an interval into its hot and cold blocks before spilling it"),
+    cl::init(true), cl::Hidden);
+
 namespace llvm {
 
 void initializeRegisterAllocatorMinimalPass(PassRegistry &Registry);
@@ -26,6 +178,43 @@ void initializeRegisterAllocatorMinimalPass(PassRegistry &Registry);
 
 namespace {
 
+/*
+Sample distribution, reported as percentiles. Used for the churn statistics where
+the tail matters more than the average: a handful of virtual registers requeued
+hundreds of times is what blows up the compile time, and that never shows in a mean.
+*/
+class Distribution {
+private:
+    SmallVector<uint64_t, 0> Samples;
+
+public:
+    void add(uint64_t Sample) {
+        Samples.push_back(Sample);
+    }
+
+    void clear() {
+        Samples.clear();
+    }
+
+    // Nearest-rank percentile, Samples have to be sorted.
+    uint64_t percentile(unsigned Percent) const {
+        size_t Rank = (Samples.size() * Percent + 99) / 100;
+        return Samples[std::max<size_t>(Rank, 1) - 1];
+    }
+
+    void print(raw_ostream &OS, StringRef Name) {
+        OS << "  " << left_justify(Name, 28);
+        if(Samples.empty()) {
+            OS << "no samples\n";
+            return;
+        }
+
+        llvm::sort(Samples);
+        OS << "n=" << Samples.size() << " p50=" << percentile(50) << " p90=" << percentile(90)
+           << " p99=" << percentile(99) << " max=" << Samples.back() << "\n";
+    }
+};
+
 class RegisterAllocatorMinimal: public MachineFunctionPass, LiveRangeEdit::Delegate {
 private:
     MachineFunction *MF;
@@ -36,165 +225,1964 @@ private:
     const SlotIndexes *SI;
 
     /*
-    Records the Valid Assignment of the Virtual Register to a Physical register.
-    If spilling is required, VirtRegMap coordinates stack slot allocation
+    Records the Valid Assignment of the Virtual Register to a Physical register.
+    If spilling is required, VirtRegMap coordinates stack slot allocation
+    */
+    VirtRegMap *VRM;
+
+    /*
+    Physical Register information of the Target Architecture
+    */
+    const TargetRegisterInfo *TRI;
+
+    /*
+    "Machine Register Info" or "Machine Register Interface", contains information about Virtual Registers
+    */
+    MachineRegisterInfo *MRI;
+
+    // Live Intervals
+    LiveIntervals *LIS;
+    
+    /*
+    LiveIntervalQueue: Keeps track of the Valid Virtual Registers which needs assignment.
+
+    The queue holds registers rather than LiveIntervals and is ordered on a cheap
+    key computed from the use lists (see getQueueKey). The interval and its spill
+    weight are only looked at once the register is dequeued.
+    Entries are (Key, ~VirtRegIndex), so ties are broken on the register number
+    and the allocation order stays deterministic.
+    */
+    std::priority_queue<std::pair<unsigned, unsigned>> LIQ;
+
+    /*
+    Trace output of the current function. Everything the allocator prints is
+    buffered here and written out in one piece once the function is done, so
+    concurrent allocator instances never share a stream.
+    NullOS swallows the trace when tracing is disabled; it is a member rather than
+    llvm::nulls() because that one is a process-wide buffered stream.
+    */
+    std::string TraceBuffer;
+    raw_string_ostream TraceOS{TraceBuffer};
+    raw_null_ostream NullOS;
+
+    /*
+    Churn statistics of the current function, collected with -regalloc-minimal-churn-stats.
+
+        IntervalLength:     length of every dequeued interval, in instructions
+        IntervalSegments:   number of segments of every dequeued interval
+        InterferenceDegree: distinct interfering virtual registers per physical
+                            register the assignment loop checks
+        EvictionDegree:     distinct interfering virtual registers per eviction
+                            attempt (see spillInterferences)
+        QueueDepth:         queue size at every dequeue
+        Enqueues:           how often each original virtual register (see
+                            VirtRegMap::getOriginal) was enqueued, including
+                            all the pieces it was split or spilled into
+    */
+    struct ChurnStatistics {
+        Distribution IntervalLength;
+        Distribution IntervalSegments;
+        Distribution InterferenceDegree;
+        Distribution EvictionDegree;
+        Distribution QueueDepth;
+        DenseMap<Register, unsigned> Enqueues;
+
+        void clear() {
+            IntervalLength.clear();
+            IntervalSegments.clear();
+            InterferenceDegree.clear();
+            EvictionDegree.clear();
+            QueueDepth.clear();
+            Enqueues.clear();
+        }
+    } Churn;
+
+    void recordDequeued(const LiveInterval &LI) {
+        if(!ReportChurn || LI.empty()) {
+            return;
+        }
+        Churn.IntervalLength.add(LI.beginIndex().distance(LI.endIndex()) / SlotIndex::InstrDist);
+        Churn.IntervalSegments.add(LI.size());
+    }
+
+    void reportChurn() {
+        Distribution Requeues;
+        for(const auto &[Reg, NumEnqueues]: Churn.Enqueues) {
+            Requeues.add(NumEnqueues - 1);
+        }
+
+        report() << "Churn statistics for " << MF->getName() << ":\n";
+        Churn.IntervalLength.print(report(), "interval length (instrs)");
+        Churn.IntervalSegments.print(report(), "interval segments");
+        Churn.InterferenceDegree.print(report(), "interference degree");
+        Churn.EvictionDegree.print(report(), "eviction degree");
+        Churn.QueueDepth.print(report(), "queue depth");
+        Requeues.print(report(), "requeues per vreg");
+    }
+
+    /*
+    Interval dump of the current function, filled while allocating when
+    -regalloc-minimal-dump-dir is given. Rows are created when a register is
+    dequeued and updated when it is assigned, evicted or spilled, so spilled
+    registers keep their row after the spiller has replaced them.
+    */
+    struct IntervalDumpBuilder {
+        SmallVector<uint32_t, 0> Columns[IntervalDump::NumColumns];
+        SmallVector<IntervalDump::Segment, 0> Segments;
+        DenseMap<Register, uint32_t> Rows;
+        StringMap<uint32_t> StringOffsets;
+        // Offset 0 is the empty string, used for "none".
+        std::string Strings = std::string(1, '\0');
+
+        uint32_t addString(StringRef Str) {
+            auto [It, Inserted] = StringOffsets.try_emplace(Str, Strings.size());
+            if(Inserted) {
+                Strings.append(Str.begin(), Str.end());
+                Strings.push_back('\0');
+            }
+            return It->second;
+        }
+
+        uint32_t getRow(Register Reg) {
+            auto [It, Inserted] = Rows.try_emplace(Reg, Columns[0].size());
+            if(Inserted) {
+                for(auto &Column: Columns) {
+                    Column.push_back(0);
+                }
+                Columns[IntervalDump::StackSlot].back() = uint32_t(-1);
+            }
+            return It->second;
+        }
+
+        uint32_t &at(IntervalDump::Column Col, uint32_t Row) {
+            return Columns[Col][Row];
+        }
+
+        void setFloat(IntervalDump::Column Col, uint32_t Row, float Value) {
+            std::memcpy(&Columns[Col][Row], &Value, sizeof(Value));
+        }
+
+        void clear() {
+            for(auto &Column: Columns) {
+                Column.clear();
+            }
+            Segments.clear();
+            Rows.clear();
+            StringOffsets.clear();
+            Strings.assign(1, '\0');
+        }
+    } Dump;
+
+    bool isDumpingIntervals() const {
+        return !IntervalDumpDir.empty();
+    }
+
+    void recordDumpDequeued(const LiveInterval &LI) {
+        Register Reg = LI.reg();
+        Register Original = VRM->getOriginal(Reg);
+        uint32_t Row = Dump.getRow(Reg);
+
+        Dump.at(IntervalDump::VirtReg, Row) = Register::virtReg2Index(Reg);
+        Dump.at(IntervalDump::OriginalReg, Row) = Register::virtReg2Index(Original);
+        Dump.at(IntervalDump::RegClassName, Row) = Dump.addString(TRI->getRegClassName(MRI->getRegClass(Reg)));
+        Dump.setFloat(IntervalDump::Weight, Row, LI.weight());
+        Dump.at(IntervalDump::Dequeues, Row)++;
+        if(Original != Reg) {
+            Dump.at(IntervalDump::History, Row) |= IntervalDump::SplitProduct;
+        }
+
+        // Keep the segments of the latest dequeue, the interval can shrink in between.
+        static_assert(SlotIndex::InstrDist == IntervalDump::SlotsPerInstruction);
+        SlotIndex Zero = LIS->getSlotIndexes()->getZeroIndex();
+        Dump.at(IntervalDump::SegmentBegin, Row) = Dump.Segments.size();
+        Dump.at(IntervalDump::SegmentCount, Row) = LI.size();
+        for(const LiveRange::Segment &Seg: LI) {
+            Dump.Segments.push_back({uint32_t(Zero.distance(Seg.start)), uint32_t(Zero.distance(Seg.end))});
+        }
+    }
+
+    void recordDumpAssigned(Register Reg, MCRegister PhysReg) {
+        uint32_t Row = Dump.getRow(Reg);
+        Dump.at(IntervalDump::History, Row) |= IntervalDump::Assigned;
+        Dump.at(IntervalDump::PhysRegName, Row) = Dump.addString(TRI->getName(PhysReg));
+    }
+
+    // Called right before LI is handed to the spiller.
+    void recordDumpSpilled(const LiveInterval &LI, bool Evicted) {
+        Register Reg = LI.reg();
+        uint32_t Row = Dump.getRow(Reg);
+
+        // Every reading instruction turns into a reload, weight them by block frequency.
+        double WeightedReloads = 0;
+        for(const MachineInstr &MI: MRI->reg_nodbg_instructions(Reg)) {
+            if(MI.readsVirtualRegister(Reg)) {
+                WeightedReloads += MBFI->getBlockFreqRelativeToEntryBlock(MI.getParent());
+            }
+        }
+
+        Dump.at(IntervalDump::History, Row) |= IntervalDump::Spilled | (Evicted ? IntervalDump::Evicted : 0);
+        Dump.at(IntervalDump::PhysRegName, Row) = 0;
+        Dump.setFloat(IntervalDump::WeightedReloads, Row, WeightedReloads);
+    }
+
+    // Stack slot assigned by the spiller, shared by everything split from the same original register.
+    void recordDumpStackSlot(Register Reg) {
+        int Slot = VRM->getStackSlot(VRM->getOriginal(Reg));
+        if(Slot != VirtRegMap::NO_STACK_SLOT) {
+            Dump.at(IntervalDump::StackSlot, Dump.getRow(Reg)) = uint32_t(Slot);
+        }
+    }
+
+    /*
+    Create the per-function output file
+        <Dir>/<function name>-<hash of module and function name>.<Extension>
+    One file per function keeps concurrent allocator instances from sharing a file.
+    Returns nullptr if the file cannot be created.
+    */
+    std::unique_ptr<raw_fd_ostream> createOutputFile(StringRef Dir, StringRef Extension, sys::fs::OpenFlags Flags) {
+        StringRef Name = MF->getName();
+        std::string FileName;
+        for(char C: Name.take_front(64)) {
+            FileName.push_back(isAlnum(C) ? C : '_');
+        }
+        std::string ModuleId = MF->getFunction().getParent()->getModuleIdentifier();
+        uint64_t Hash = xxh3_64bits(ModuleId + '\0' + Name.str());
+        FileName += "-" + utohexstr(Hash, /*LowerCase=*/true, /*Width=*/16) + "." + Extension.str();
+
+        SmallString<256> Path(Dir);
+        sys::path::append(Path, FileName);
+        std::error_code EC = sys::fs::create_directories(Dir);
+        auto OS = std::make_unique<raw_fd_ostream>(Path, EC, Flags);
+        if(EC) {
+            report() << "Cannot write " << Path << ": " << EC.message() << "\n";
+            return nullptr;
+        }
+        return OS;
+    }
+
+    // Write the dump of the current function to IntervalDumpDir.
+    void writeIntervalDump() {
+        std::unique_ptr<raw_fd_ostream> File = createOutputFile(IntervalDumpDir, "rai", sys::fs::OF_None);
+        if(!File) {
+            return;
+        }
+        raw_fd_ostream &OS = *File;
+
+        IntervalDump::FileHeader Header = {};
+        std::memcpy(Header.Magic, IntervalDump::Magic, sizeof(Header.Magic));
+        Header.Version = IntervalDump::Version;
+        Header.NumRows = Dump.Columns[0].size();
+        Header.NumSegments = Dump.Segments.size();
+        Header.FunctionName = Dump.addString(MF->getName());
+
+        uint64_t Offset = alignTo(sizeof(Header), 8);
+        for(unsigned Col = 0; Col < IntervalDump::NumColumns; Col++) {
+            Header.ColumnOffset[Col] = Offset;
+            Offset = alignTo(Offset + Header.NumRows * sizeof(uint32_t), 8);
+        }
+        Header.SegmentOffset = Offset;
+        Offset = alignTo(Offset + Header.NumSegments * sizeof(IntervalDump::Segment), 8);
+        Header.StringTableOffset = Offset;
+        Header.StringTableSize = Dump.Strings.size();
+
+        auto writeAligned = [&](const void *Data, size_t Size) {
+            OS.write(reinterpret_cast<const char *>(Data), Size);
+            OS.write_zeros(offsetToAlignment(OS.tell(), Align(8)));
+        };
+        writeAligned(&Header, sizeof(Header));
+        for(const auto &Column: Dump.Columns) {
+            writeAligned(Column.data(), Column.size() * sizeof(uint32_t));
+        }
+        writeAligned(Dump.Segments.data(), Dump.Segments.size() * sizeof(IntervalDump::Segment));
+        OS.write(Dump.Strings.data(), Dump.Strings.size());
+    }
+
+    /*
+    Interference graph of the current function, exported with -regalloc-minimal-export-graph.
+
+    The graph is taken before allocation starts, so it is the problem the allocator
+    was given, not what is left after spilling. Nodes are the virtual registers,
+    edges connect registers whose intervals overlap and whose classes share a
+    register unit. After allocation each node is colored with its register, or
+    marked as spilled.
+
+    Per register class the export carries
+        K:        the number of allocatable registers of the class
+        MaxLive:  the highest number of registers of the class live at one slot
+                  index. The graph contains a clique of that size, so it is a lower
+                  bound on the colors needed.
+    If MaxLive > K, spills of that class are forced by pressure. If MaxLive <= K,
+    the spills were chosen by the heuristic.
+    */
+    struct InterferenceGraph {
+        struct ClassStats {
+            unsigned K = 0;
+            unsigned MaxLive = 0;
+            unsigned NumNodes = 0;
+        };
+
+        // Function, or the loop the graph is restricted to
+        std::string Scope;
+        SmallVector<Register, 0> Nodes;
+        SmallVector<float, 0> Weights;
+        SmallVector<unsigned, 0> Degrees;
+        SmallVector<std::pair<unsigned, unsigned>, 0> Edges;
+        MapVector<const TargetRegisterClass *, ClassStats> Classes;
+
+        void clear() {
+            Scope.clear();
+            Nodes.clear();
+            Weights.clear();
+            Degrees.clear();
+            Edges.clear();
+            Classes.clear();
+        }
+    } Graph;
+
+    // Loop info of the current function
+    const MachineLoopInfo *MLI;
+
+    // True if some register of class A shares a register unit with some register of class B.
+    bool classesInterfere(const TargetRegisterClass *A, const TargetRegisterClass *B,
+                          DenseMap<std::pair<const TargetRegisterClass *, const TargetRegisterClass *>, bool> &Cache) {
+        auto [It, Inserted] = Cache.try_emplace(std::make_pair(A, B), false);
+        if(Inserted) {
+            It->second = any_of(RCI.getOrder(A), [&](MCPhysReg RegA) {
+                return any_of(RCI.getOrder(B), [&](MCPhysReg RegB) {
+                    return TRI->regsOverlap(RegA, RegB);
+                });
+            });
+        }
+        return It->second;
+    }
+
+    void buildInterferenceGraph() {
+        Graph.clear();
+        Graph.Scope = "function";
+
+        // Optionally only look at the slot index ranges of the hottest loop.
+        SmallVector<std::pair<SlotIndex, SlotIndex>, 8> Ranges;
+        if(InterferenceGraphHottestLoop) {
+            // Every loop is found through its header.
+            const MachineLoop *Hottest = nullptr;
+            for(const MachineBasicBlock &MBB: *MF) {
+                const MachineLoop *L = MLI->getLoopFor(&MBB);
+                if(!L || L->getHeader() != &MBB) {
+                    continue;
+                }
+                if(!Hottest || MBFI->getBlockFreq(&MBB) > MBFI->getBlockFreq(Hottest->getHeader())) {
+                    Hottest = L;
+                }
+            }
+            if(Hottest) {
+                Graph.Scope = "loop ";
+                raw_string_ostream(Graph.Scope) << printMBBReference(*Hottest->getHeader());
+                for(const MachineBasicBlock *MBB: Hottest->blocks()) {
+                    Ranges.push_back(LIS->getSlotIndexes()->getMBBRange(MBB));
+                }
+            }
+        }
+
+        SmallVector<const LiveInterval *, 0> Intervals;
+        for(unsigned VirtRegIdx = 0; VirtRegIdx < MRI->getNumVirtRegs(); VirtRegIdx++) {
+            Register Reg = Register::index2VirtReg(VirtRegIdx);
+            if(MRI->reg_nodbg_empty(Reg)) {
+                continue;
+            }
+
+            LiveInterval &LI = LIS->getInterval(Reg);
+            if(LI.empty()) {
+                continue;
+            }
+            if(!Ranges.empty() && none_of(Ranges, [&](const std::pair<SlotIndex, SlotIndex> &Range) {
+                   return LI.overlaps(Range.first, Range.second);
+               })) {
+                continue;
+            }
+
+            VRAI->calculateSpillWeightAndHint(LI);
+            Intervals.push_back(&LI);
+        }
+
+        // Sweep in order of start, only intervals starting before LI ends can overlap it.
+        llvm::sort(Intervals, [](const LiveInterval *A, const LiveInterval *B) {
+            return A->beginIndex() < B->beginIndex();
+        });
+        DenseMap<std::pair<const TargetRegisterClass *, const TargetRegisterClass *>, bool> InterferenceCache;
+        Graph.Degrees.assign(Intervals.size(), 0);
+        for(unsigned Node = 0; Node < Intervals.size(); Node++) {
+            const LiveInterval *LI = Intervals[Node];
+            const TargetRegisterClass *RC = MRI->getRegClass(LI->reg());
+            Graph.Nodes.push_back(LI->reg());
+            Graph.Weights.push_back(LI->weight());
+
+            InterferenceGraph::ClassStats &Stats = Graph.Classes[RC];
+            Stats.K = RCI.getNumAllocatableRegs(RC);
+            Stats.NumNodes++;
+
+            for(unsigned Other = Node + 1; Other < Intervals.size(); Other++) {
+                const LiveInterval *OtherLI = Intervals[Other];
+                if(OtherLI->beginIndex() >= LI->endIndex()) {
+                    break;
+                }
+                if(classesInterfere(RC, MRI->getRegClass(OtherLI->reg()), InterferenceCache) && LI->overlaps(*OtherLI)) {
+                    Graph.Edges.push_back(std::make_pair(Node, Other));
+                    Graph.Degrees[Node]++;
+                    Graph.Degrees[Other]++;
+                }
+            }
+        }
+
+        // MaxLive per class: sweep the (clipped) segment boundaries, ends before starts at equal indexes.
+        for(auto &[RC, Stats]: Graph.Classes) {
+            SmallVector<std::pair<SlotIndex, int>, 0> Events;
+            auto addSegment = [&](SlotIndex Start, SlotIndex End) {
+                if(Start < End) {
+                    Events.push_back(std::make_pair(Start, 1));
+                    Events.push_back(std::make_pair(End, -1));
+                }
+            };
+            for(const LiveInterval *LI: Intervals) {
+                if(MRI->getRegClass(LI->reg()) != RC) {
+                    continue;
+                }
+                for(const LiveRange::Segment &Seg: *LI) {
+                    if(Ranges.empty()) {
+                        addSegment(Seg.start, Seg.end);
+                    }
+                    for(const auto &[RangeStart, RangeEnd]: Ranges) {
+                        addSegment(std::max(Seg.start, RangeStart), std::min(Seg.end, RangeEnd));
+                    }
+                }
+            }
+
+            llvm::sort(Events);
+            int Live = 0;
+            for(const auto &[Index, Delta]: Events) {
+                Live += Delta;
+                Stats.MaxLive = std::max<unsigned>(Stats.MaxLive, Live);
+            }
+        }
+    }
+
+    // Color of a node after allocation: its register, "spilled", or "-" if neither.
+    std::string getNodeColor(Register Reg) const {
+        if(VRM->hasPhys(Reg)) {
+            return TRI->getName(VRM->getPhys(Reg));
+        }
+        if(VRM->getStackSlot(VRM->getOriginal(Reg)) != VirtRegMap::NO_STACK_SLOT) {
+            return "spilled";
+        }
+        return "-";
+    }
+
+    std::string getGraphStats() const {
+        std::string Stats;
+        raw_string_ostream OS(Stats);
+        OS << "scope=" << Graph.Scope << " nodes=" << Graph.Nodes.size() << " edges=" << Graph.Edges.size();
+        for(const auto &[RC, ClassStats]: Graph.Classes) {
+            OS << "; " << TRI->getRegClassName(RC) << ": K=" << ClassStats.K << " MaxLive=" << ClassStats.MaxLive
+               << " nodes=" << ClassStats.NumNodes
+               << (ClassStats.MaxLive > ClassStats.K ? " (pressure bound)" : "");
+        }
+
+        // Degree distribution, as degree:count pairs
+        std::map<unsigned, unsigned> DegreeCounts;
+        for(unsigned Degree: Graph.Degrees) {
+            DegreeCounts[Degree]++;
+        }
+        OS << "; degrees=";
+        ListSeparator Sep(",");
+        for(const auto &[Degree, Count]: DegreeCounts) {
+            OS << Sep << Degree << ":" << Count;
+        }
+        return Stats;
+    }
+
+    static std::string escapeXML(StringRef Str) {
+        std::string Escaped;
+        for(char C: Str) {
+            switch(C) {
+                case '<': Escaped += "&lt;"; break;
+                case '>': Escaped += "&gt;"; break;
+                case '&': Escaped += "&amp;"; break;
+                case '"': Escaped += "&quot;"; break;
+                default: Escaped.push_back(C);
+            }
+        }
+        return Escaped;
+    }
+
+    void writeInterferenceGraph() {
+        bool IsDOT = ExportInterferenceGraph == GraphFormat::DOT;
+        std::unique_ptr<raw_fd_ostream> File =
+            createOutputFile(InterferenceGraphDir, IsDOT ? "dot" : "graphml", sys::fs::OF_Text);
+        if(!File) {
+            return;
+        }
+        raw_fd_ostream &OS = *File;
+        std::string Stats = getGraphStats();
+        report() << "Interference graph of " << MF->getName() << ": " << Stats << "\n";
+
+        if(IsDOT) {
+            OS << "graph \"" << DOT::EscapeString(MF->getName().str()) << "\" {\n";
+            OS << "  label=\"" << DOT::EscapeString(Stats) << "\";\n";
+            for(unsigned Node = 0; Node < Graph.Nodes.size(); Node++) {
+                Register Reg = Graph.Nodes[Node];
+                OS << "  n" << Node << " [label=\"" << printReg(Reg, TRI) << "\\n"
+                   << TRI->getRegClassName(MRI->getRegClass(Reg)) << "\\nw=" << format("%.3g", Graph.Weights[Node])
+                   << "\\n" << getNodeColor(Reg) << "\"];\n";
+            }
+            for(const auto &[From, To]: Graph.Edges) {
+                OS << "  n" << From << " -- n" << To << ";\n";
+            }
+            OS << "}\n";
+            return;
+        }
+
+        OS << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           << "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+           << "  <key id=\"stats\" for=\"graph\" attr.name=\"stats\" attr.type=\"string\"/>\n"
+           << "  <key id=\"vreg\" for=\"node\" attr.name=\"vreg\" attr.type=\"string\"/>\n"
+           << "  <key id=\"class\" for=\"node\" attr.name=\"class\" attr.type=\"string\"/>\n"
+           << "  <key id=\"weight\" for=\"node\" attr.name=\"weight\" attr.type=\"double\"/>\n"
+           << "  <key id=\"degree\" for=\"node\" attr.name=\"degree\" attr.type=\"int\"/>\n"
+           << "  <key id=\"color\" for=\"node\" attr.name=\"color\" attr.type=\"string\"/>\n"
+           << "  <graph id=\"" << escapeXML(MF->getName()) << "\" edgedefault=\"undirected\">\n"
+           << "    <data key=\"stats\">" << escapeXML(Stats) << "</data>\n";
+        for(unsigned Node = 0; Node < Graph.Nodes.size(); Node++) {
+            Register Reg = Graph.Nodes[Node];
+            std::string RegName;
+            raw_string_ostream(RegName) << printReg(Reg, TRI);
+            OS << "    <node id=\"n" << Node << "\">"
+               << "<data key=\"vreg\">" << escapeXML(RegName) << "</data>"
+               << "<data key=\"class\">" << escapeXML(TRI->getRegClassName(MRI->getRegClass(Reg))) << "</data>"
+               << "<data key=\"weight\">" << format("%g", Graph.Weights[Node]) << "</data>"
+               << "<data key=\"degree\">" << Graph.Degrees[Node] << "</data>"
+               << "<data key=\"color\">" << escapeXML(getNodeColor(Reg)) << "</data>"
+               << "</node>\n";
+        }
+        for(const auto &[From, To]: Graph.Edges) {
+            OS << "    <edge source=\"n" << From << "\" target=\"n" << To << "\"/>\n";
+        }
+        OS << "  </graph>\n</graphml>\n";
+    }
+
+    raw_ostream &trace() {
+        return TraceAllocation ? static_cast<raw_ostream &>(TraceOS) : NullOS;
+    }
+
+    /*
+    Reports (churn statistics, ...) are written to the same buffer as the trace, they
+    are just not gated on -regalloc-minimal-trace.
+    */
+    raw_ostream &report() {
+        return TraceOS;
+    }
+
+    // Write the buffered trace and reports of the current function to outs()
+    void flushTrace() {
+        TraceOS.flush();
+        if(TraceBuffer.empty()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> Lock(TraceOutputMutex);
+            outs() << TraceBuffer;
+            outs().flush();
+        }
+        TraceBuffer.clear();
+    }
+
+    /*
+    Allocation priority of a Virtual Register, computed without touching its LiveInterval.
+
+    Walks the def/use list once and combines
+        - the block span: distance in layout order between the first and the last
+          block that reference the register, and
+        - the number of non-debug defs and uses.
+    Registers spanning more blocks and having more references are allocated first,
+    they are the hardest to place once the register file fills up.
+
+    With the LoopNest order, the deepest loop depth and the hottest block frequency
+    (as a power of two) among the references go in front of both.
+    */
+    unsigned getQueueKey(Register Reg) const {
+        unsigned NumRefs = 0;
+        int FirstBlock = INT_MAX;
+        int LastBlock = INT_MIN;
+        unsigned LoopDepth = 0;
+        unsigned FrequencyLog = 0;
+        for(const MachineOperand &MO: MRI->reg_nodbg_operands(Reg)) {
+            const MachineBasicBlock *MBB = MO.getParent()->getParent();
+            int BlockNum = MBB->getNumber();
+            FirstBlock = std::min(FirstBlock, BlockNum);
+            LastBlock = std::max(LastBlock, BlockNum);
+            NumRefs++;
+
+            if(Options.Order == RegAllocMinimalOrder::LoopNest) {
+                LoopDepth = std::max(LoopDepth, MLI->getLoopDepth(MBB));
+                FrequencyLog = std::max(FrequencyLog, Log2_64(MBFI->getBlockFreq(MBB).getFrequency() | 1));
+            }
+        }
+
+        unsigned BlockSpan = NumRefs ? LastBlock - FirstBlock + 1 : 0;
+        if(Options.Order == RegAllocMinimalOrder::LoopNest) {
+            return (std::min(LoopDepth, 0xfu) << 28) | (std::min(FrequencyLog, 0x3fu) << 22)
+                   | (std::min(BlockSpan, 0x7ffu) << 11) | std::min(NumRefs, 0x7ffu);
+        }
+        return (std::min(BlockSpan, 0xffffu) << 16) | std::min(NumRefs, 0xffffu);
+    }
+
+    // Add Virtual Register Reg to Queue
+    void enqueue(Register Reg) {
+        unsigned Key = getQueueKey(Reg);
+        trace() << "Adding {Register=" << printReg(Reg, TRI) << ", Key=" << Key << "}\n";
+        LIQ.push(std::make_pair(Key, ~Register::virtReg2Index(Reg)));
+        UsePositions.erase(Reg);
+
+        unsigned &NumEnqueues = Churn.Enqueues[VRM->getOriginal(Reg)];
+        if(NumEnqueues++) {
+            NumRequeues++;
+            Stats.NumRequeues++;
+        }
+    }
+
+    // Remove the Virtual Register with the highest key from the Queue.
+    Register dequeue() {
+        if(LIQ.empty()) {
+            return Register();
+        }
+        if(ReportChurn) {
+            Churn.QueueDepth.add(LIQ.size());
+        }
+        Register Reg = Register::index2VirtReg(~LIQ.top().second);
+        LIQ.pop();
+        trace() << "Popping {Reg=" << printReg(Reg, TRI) << "}\n";
+
+        return Reg;
+    }
+
+    /*
+    The LiveRegMatrix class in LLVM tracks virtual register interference along two dimensions: slot indexes and register units.
+    
+    Contains information about the Interferences. This is similar to Interference Graph.
+    
+    The "smallest units of interference" in the context of register allocation refers to register units, which represent 
+    the most granular level at which registers can interfere with each other.
+
+    For example:
+        1. In x86, there are overlapping registers of different sizes, such as:
+            - AL (8-bit)
+            - AX (16-bit, contains AL)
+            - EAX (32-bit, contains AX)
+            - RAX (64-bit, contains EAX)
+        2. Register units for these might look like:
+            - AL: Unit 1
+            - AH: Unit 2
+            .
+            .
+        In this example, if a virtual register is assigned to AL, it would interfere with any other virtual register assigned to AL, AX, EAX, or RAX, but not with AH.
+    */
+    LiveRegMatrix *LRM;
+
+    // Register Class Information
+    RegisterClassInfo RCI;
+
+    /*
+    Register units that are reserved, fixed or have been assigned in the current
+    function. Candidates outside of them are free without a LiveRegMatrix query.
+    */
+    std::unique_ptr<regalloc::UnitOccupancy> Occupancy;
+
+    /*
+    Register units of the callee-saved registers of the current function, and the
+    ones of them that are already used on the hot path (see isOnHotPath).
+    */
+    BitVector CalleeSavedUnits;
+    BitVector HotCalleeSavedUnits;
+
+    /*
+    Computes spill weights and copy hints. Weights are computed lazily, when a
+    register is dequeued, instead of for every virtual register up front.
+    */
+    std::unique_ptr<VirtRegAuxInfo> VRAI;
+
+    // Block Frequencies, relative to the entry block
+    const MachineBlockFrequencyInfo *MBFI;
+
+    // Spiller
+    std::unique_ptr<Spiller> SpillerInst;
+    // Track machine instructions that define original registers but become dead after rematerialization.
+    SmallPtrSet<MachineInstr *, 32> DeadRemats;
+
+    /*
+    Options the pass was created with, and the tier used for the current function
+    after looking at the RegAllocMinimalTierAttr function attribute.
+    */
+    RegAllocMinimalOptions Options;
+    RegAllocMinimalTier Tier;
+
+    // Statistics of the current function, handed to StatsHandler once it is done
+    RegAllocMinimalStats Stats;
+    RegAllocMinimalStatsHandler StatsHandler;
+
+    RegAllocMinimalTier getFunctionTier(const MachineFunction &MF) const {
+        Attribute TierAttr = MF.getFunction().getFnAttribute(RegAllocMinimalTierAttr);
+        if(!Options.HonorTierAttribute || !TierAttr.isStringAttribute()) {
+            return Options.Tier;
+        }
+
+        StringRef Value = TierAttr.getValueAsString();
+        if(Value == "fast") {
+            return RegAllocMinimalTier::Fast;
+        }
+        if(Value == "full") {
+            return RegAllocMinimalTier::Full;
+        }
+        return Options.Tier;
+    }
+
+
+public:
+    static char ID;
+
+    StringRef getPassName() const override {
+        return "Minimal Register Allocator";
+    }
+
+    // Options of the registered allocators, taken from the command line
+    static RegAllocMinimalOptions getCommandLineOptions(RegAllocMinimalTier Tier = RegAllocMinimalTier::Full) {
+        RegAllocMinimalOptions Options;
+        Options.Tier = Tier;
+        Options.GenericUnitKernel = GenericUnitKernel;
+        Options.Order = AllocationOrder;
+        Options.LocalSplitGap = LocalSplitGap;
+        Options.NextUseEviction = NextUseEviction;
+        Options.AvoidFalseDependencies = AvoidFalseDependencies;
+        Options.FalseDependencyMinFrequency = FalseDependencyMinFrequency;
+        Options.ColdBlockFrequency = ColdBlockFrequency;
+        Options.HotPathCallerSaved = HotPathCallerSaved;
+        Options.HotColdSplit = HotColdSplit;
+        Options.SpillPacking = SpillPacking;
+        Options.SpillPackingWindow = SpillPackingWindow;
+        return Options;
+    }
+
+    RegisterAllocatorMinimal(const RegAllocMinimalOptions &Options = getCommandLineOptions(),
+                             RegAllocMinimalStatsHandler StatsHandler = nullptr)
+        : MachineFunctionPass(ID), Options(Options), Tier(Options.Tier), StatsHandler(std::move(StatsHandler)) {
+        initializeRegisterAllocatorMinimalPass(*PassRegistry::getPassRegistry());
+    }
+
+    /*
+    Get the requried analysis passes
+    */
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        MachineFunctionPass::getAnalysisUsage(AU);
+        AU.setPreservesCFG();
+
+#define REQUIRE_AND_PRESERVE_PASS(PassName)                                    \
+  AU.addRequired<PassName>();                                                  \
+  AU.addPreserved<PassName>()
+
+        REQUIRE_AND_PRESERVE_PASS(SlotIndexesWrapperPass);
+        REQUIRE_AND_PRESERVE_PASS(VirtRegMap);
+        REQUIRE_AND_PRESERVE_PASS(LiveIntervalsWrapperPass);
+        REQUIRE_AND_PRESERVE_PASS(LiveRegMatrix);
+
+        // implicitly requested by the spiller
+        REQUIRE_AND_PRESERVE_PASS(LiveStacks);
+        REQUIRE_AND_PRESERVE_PASS(AAResultsWrapperPass);
+        REQUIRE_AND_PRESERVE_PASS(MachineDominatorTreeWrapperPass);
+        REQUIRE_AND_PRESERVE_PASS(MachineLoopInfoWrapperPass);
+        REQUIRE_AND_PRESERVE_PASS(MachineBlockFrequencyInfoWrapperPass);
+    }
+
+    /*
+    Request PHI Nodes are removed before doing Register Allocation
+    */
+    MachineFunctionProperties getRequiredProperties() const override {
+        return MachineFunctionProperties().set(
+            MachineFunctionProperties::Property::NoPHIs
+        );
+    }
+
+    /*
+    Get the Register Units for the Physical Register. Collect the Interfering
+    VirtRegs. 
+    Only if all the Reg Units are spillable, and their spill cost is less than the
+    current LI for which we are trying to assign PhysReg, then we spill those
+    virtRegs(IntfLI)
+    */
+    bool spillInterferences(LiveInterval *const LI, MCRegister PhysReg, SmallVectorImpl<Register> *const SplitVirtRegs) {
+        SmallVector<const LiveInterval *, 8> IntfLIs;
+        collectInterferingVRegs(*LI, PhysReg, IntfLIs);
+        if(ReportChurn) {
+            Churn.EvictionDegree.add(IntfLIs.size());
+        }
+
+        for(const LiveInterval *const IntfLI: IntfLIs) {
+            if(!IntfLI->isSpillable() || IntfLI->weight() > LI->weight() || !isRepairEvictable(*IntfLI)) {
+                return false;
+            }
+        }
+        if(Options.Repair && Stats.NumEvictions + IntfLIs.size() > Options.RepairEvictionBudget) {
+            return false;
+        }
+
+        evictInterferences(IntfLIs, *SplitVirtRegs);
+        return true;
+    }
+
+    /*
+    Virtual registers assigned to a unit of PhysReg that interfere with LI, each
+    once: a register that covers several units of PhysReg shows up in the query
+    of every one of them.
+    */
+    void collectInterferingVRegs(const LiveInterval &LI, MCRegister PhysReg,
+                                 SmallVectorImpl<const LiveInterval *> &IntfLIs) {
+        SmallPtrSet<const LiveInterval *, 8> Seen;
+        for(MCRegUnitIterator RegUnit(PhysReg, TRI); RegUnit.isValid(); RegUnit++) {
+            LiveIntervalUnion::Query &Q = LRM->query(LI, *RegUnit);
+            for(const LiveInterval *const IntfLI: Q.interferingVRegs()) {
+                if(Seen.insert(IntfLI).second) {
+                    IntfLIs.push_back(IntfLI);
+                }
+            }
+        }
+    }
+
+    // Unassign and spill the interfering intervals IntfLIs.
+    void evictInterferences(ArrayRef<const LiveInterval *> IntfLIs, SmallVectorImpl<Register> &SplitVirtRegs) {
+        // Spill each interfering vreg allocated to PhysRegs.
+        for(unsigned IntfIdx = 0; IntfIdx < IntfLIs.size(); IntfIdx++) {
+            const LiveInterval *const LIToSpill = IntfLIs[IntfIdx];
+
+            /*
+            Avoid duplicates
+
+            This check ensures that we only process virtual registers (LIToSpill) that are 
+            currently assigned to physical registers by the VirtRegMap (VRM)
+            */
+            if(!VRM->hasPhys(LIToSpill->reg())) {
+                continue;
+            }
+
+            LRM->unassign(*LIToSpill);
+            spillInterval(LIToSpill, SplitVirtRegs, /*Evicted=*/true);
+            Stats.NumEvictions++;
+        }
+    }
+
+    /*
+    Sorted positions of the reads of each virtual register, the next-use table of
+    the furthest-next-use eviction. An entry is built on first use and dropped
+    when the register is enqueued again, which is what happens to every register
+    a split or a spill changes.
+    */
+    DenseMap<Register, SmallVector<SlotIndex, 8>> UsePositions;
+
+    // First read of Reg at or after Index, the end of MBB if there is none.
+    SlotIndex getNextUse(Register Reg, SlotIndex Index, const MachineBasicBlock &MBB) {
+        auto [It, Inserted] = UsePositions.try_emplace(Reg);
+        SmallVectorImpl<SlotIndex> &Uses = It->second;
+        if(Inserted) {
+            for(const MachineInstr &MI: MRI->reg_nodbg_instructions(Reg)) {
+                if(MI.readsVirtualRegister(Reg)) {
+                    Uses.push_back(LIS->getInstructionIndex(MI).getBaseIndex());
+                }
+            }
+            llvm::sort(Uses);
+        }
+
+        auto Next = llvm::lower_bound(Uses, Index.getBaseIndex());
+        return Next == Uses.end() ? LIS->getMBBEndIdx(&MBB) : *Next;
+    }
+
+    /*
+    Belady's MIN for an interval local to one block: when LI does not fit, the
+    value whose next use is furthest away goes to memory.
+
+    At the start of LI, each candidate register is scored by the nearest next
+    use among the intervals assigned to it, since all of them would be
+    evicted. Only candidates whose interferences are spillable and local to
+    the same block compete. The best one wins if its score is further away than
+    the first use of LI. Otherwise LI is the furthest value and is spilled
+    itself, unless it cannot be.
+
+    Returns false if no candidate competes, and the tier's own eviction rules
+    apply. Otherwise Victim is the register to take, with the intervals to evict
+    in Evictees, or 0 when LI is to be spilled.
+    */
+    bool chooseByNextUse(const LiveInterval &LI, ArrayRef<MCRegister> Candidates, MCRegister &Victim,
+                         SmallVectorImpl<const LiveInterval *> &Evictees) {
+        const MachineBasicBlock *MBB = LIS->intervalIsInOneMBB(LI);
+        if(!Options.NextUseEviction || !MBB) {
+            return false;
+        }
+
+        SlotIndex Start = LI.beginIndex();
+        bool Found = false;
+        SlotIndex BestNextUse;
+        Victim = MCRegister();
+        for(MCRegister PhysReg: Candidates) {
+            SmallVector<const LiveInterval *, 4> IntfLIs;
+            SlotIndex NearestNextUse = LIS->getMBBEndIdx(MBB);
+            bool Competes = true;
+            for(MCRegUnitIterator RegUnit(PhysReg, TRI); Competes && RegUnit.isValid(); ++RegUnit) {
+                for(const LiveInterval *IntfLI: LRM->query(LI, *RegUnit).interferingVRegs()) {
+                    if(!IntfLI->isSpillable() || LIS->intervalIsInOneMBB(*IntfLI) != MBB) {
+                        Competes = false;
+                        break;
+                    }
+                    NearestNextUse = std::min(NearestNextUse, getNextUse(IntfLI->reg(), Start, *MBB));
+                    IntfLIs.push_back(IntfLI);
+                }
+            }
+            if(!Competes) {
+                continue;
+            }
+
+            if(!Found || NearestNextUse > BestNextUse) {
+                Found = true;
+                BestNextUse = NearestNextUse;
+                Victim = PhysReg;
+                Evictees.assign(IntfLIs.begin(), IntfLIs.end());
+            }
+        }
+        if(!Found) {
+            return false;
+        }
+
+        if(LI.isSpillable() && getNextUse(LI.reg(), Start, *MBB) >= BestNextUse) {
+            Victim = MCRegister();
+            Evictees.clear();
+        }
+        return true;
+    }
+
+
+
+
+    /*
+    Compute the interval of NewReg, created with LiveRangeEdit::createFrom(Parent)
+    before its instructions were in place. createFrom only computes an (empty)
+    interval when Parent is not spillable.
+    */
+    void computeSplitInterval(Register NewReg, const LiveInterval &Parent) {
+        if(LIS->hasInterval(NewReg)) {
+            LIS->removeInterval(NewReg);
+        }
+        LiveInterval &NewLI = LIS->createAndComputeVirtRegInterval(NewReg);
+        if(!Parent.isSpillable()) {
+            NewLI.markNotSpillable();
+        }
+    }
+
+    /*
+    Shrink LI to the references left after a split. Components of it that came
+    apart get registers of their own, they are appended to NewVirtRegs.
+    */
+    void shrinkAfterSplit(LiveInterval &LI, SmallVectorImpl<Register> &NewVirtRegs) {
+        if(!LIS->shrinkToUses(&LI)) {
+            return;
+        }
+
+        SmallVector<LiveInterval *, 4> Components;
+        LIS->splitSeparateComponents(LI, Components);
+        VRM->grow();
+        for(LiveInterval *Component: Components) {
+            VRM->setIsSplitFromReg(Component->reg(), VRM->getOriginal(LI.reg()));
+            NewVirtRegs.push_back(Component->reg());
+        }
+    }
+
+    /*
+    Split an interval local to one block at the widest stretch without references
+    to it, instead of spilling it everywhere:
+
+        %v = ...                        %v = ...
+        ... = use %v                    ... = use %v
+                                        %g = COPY %v
+        (LocalSplitGap or more   =>     (gap)
+         instructions)                  %w = COPY %g
+        ... = use %v                    ... = use %w
+
+    %v and %w keep the dense references on either side and can hold a register
+    there, %g covers the gap with nothing but the two copies. If the pressure in the
+    gap is what made LI fail, %g is spilled: one store and one reload, and
+    the references stay in registers. When %g does get a register, the copy hints
+    usually give all three the same one and the copies disappear.
+
+    SlotIndex distances between consecutive references find the gap. Both sides
+    need two references at least, so the gap register itself is never split again
+    and every split leaves strictly smaller intervals behind. The new registers and
+    LI itself are appended to NewVirtRegs.
+    */
+    bool splitAtUseGap(LiveInterval &LI, SmallVectorImpl<Register> &NewVirtRegs) {
+        if(!Options.LocalSplitGap || !LIS->intervalIsInOneMBB(LI)) {
+            return false;
+        }
+
+        Register Reg = LI.reg();
+        SmallVector<std::pair<SlotIndex, MachineInstr *>, 16> Refs;
+        for(MachineInstr &MI: MRI->reg_nodbg_instructions(Reg)) {
+            Refs.push_back(std::make_pair(LIS->getInstructionIndex(MI), &MI));
+        }
+        llvm::sort(Refs, [](const auto &A, const auto &B) {
+            return A.first < B.first;
+        });
+        Refs.erase(std::unique(Refs.begin(), Refs.end()), Refs.end());
+        if(Refs.size() < 4) {
+            return false;
+        }
+
+        // Cut goes between Refs[Cut - 1] and Refs[Cut]
+        size_t Cut = 0;
+        int Widest = 0;
+        for(size_t Idx = 2; Idx + 2 <= Refs.size(); Idx++) {
+            int Gap = Refs[Idx - 1].first.getApproxInstrDistance(Refs[Idx].first);
+            if(Gap > Widest) {
+                Widest = Gap;
+                Cut = Idx;
+            }
+        }
+        if(Widest < int(Options.LocalSplitGap)) {
+            return false;
+        }
+
+        // The value has to flow through the gap, not be redefined after it.
+        MachineInstr *Before = Refs[Cut - 1].second;
+        MachineInstr *After = Refs[Cut].second;
+        if(Before->isTerminator() || !After->readsVirtualRegister(Reg)) {
+            return false;
+        }
+
+        LiveRangeEdit LRE(&LI, NewVirtRegs, *MF, *LIS, VRM, this, &DeadRemats);
+        Register GapReg = LRE.createFrom(Reg);
+        Register TailReg = LRE.createFrom(Reg);
+
+        MachineBasicBlock &MBB = *After->getParent();
+        const TargetInstrInfo *TII = MF->getSubtarget().getInstrInfo();
+        MachineInstr *ToGap = BuildMI(MBB, std::next(Before->getIterator()), DebugLoc(),
+                                      TII->get(TargetOpcode::COPY), GapReg).addReg(Reg);
+        MachineInstr *FromGap = BuildMI(MBB, After->getIterator(), DebugLoc(),
+                                        TII->get(TargetOpcode::COPY), TailReg).addReg(GapReg);
+        LIS->InsertMachineInstrInMaps(*ToGap);
+        LIS->InsertMachineInstrInMaps(*FromGap);
+
+        // LI is local, every reference after the gap is in this block. Debug values included.
+        for(MachineInstr &MI: make_range(MachineBasicBlock::iterator(After), MBB.end())) {
+            for(MachineOperand &MO: MI.operands()) {
+                if(MO.isReg() && MO.getReg() == Reg) {
+                    MO.setReg(TailReg);
+                }
+            }
+        }
+        computeSplitInterval(GapReg, LI);
+        computeSplitInterval(TailReg, LI);
+
+        NewVirtRegs.push_back(Reg);
+        shrinkAfterSplit(LI, NewVirtRegs);
+
+        trace() << "Split " << printReg(Reg, TRI) << " at a gap of " << Widest << " instructions into "
+                << printReg(GapReg, TRI) << " and " << printReg(TailReg, TRI) << "\n";
+        return true;
+    }
+
+    // Registers created by splitHotCold, they are not split that way again.
+    DenseSet<Register> HotColdSplitRegs;
+
+    /*
+    Call Fn for every block a segment of LI overlaps, in layout order per segment.
+    A block covered by several segments is visited once per segment. Stops at the
+    first call that returns true, and returns whether one did.
+    */
+    bool forEachCoveredBlock(const LiveInterval &LI, function_ref<bool(MachineBasicBlock &)> Fn) const {
+        for(const LiveRange::Segment &Segment: LI) {
+            MachineFunction::iterator MBB = LIS->getMBBFromIndex(Segment.start)->getIterator();
+            for(; MBB != MF->end() && LIS->getMBBStartIdx(&*MBB) < Segment.end; ++MBB) {
+                if(Fn(*MBB)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /*
+    Split an interval that crosses hot and cold blocks (see isColdBlock) by block
+    frequency, instead of spilling it everywhere:
+
+        entry:                          entry:
+            %v = ...                        %h = ...
+            JCC %slow                       JCC %slow
+        fast:                           fast:
+            ... = use %v                    ... = use %h
+            RET                     =>      RET
+        slow:                           slow:
+            ... = use %v                    %c = COPY %h
+            JMP %fast                       ... = use %c
+                                            %h = COPY %c
+                                            JMP %fast
+
+    %h takes the references in hot blocks, %c the ones in cold blocks, and copies
+    sit on the edges between the two where the value is live. A hot to cold copy
+    goes to the start of the cold block if all its predecessors are hot, otherwise
+    to the end of the hot one. A cold to hot copy goes to the end of the cold
+    block. If %c is then spilled, its stores and reloads land in cold blocks and
+    the hot path keeps the register. Unlike splitAtLoopPreheader this needs no
+    loop: the hot path through a dispatcher is a chain of blocks.
+
+    Needs a reference in a hot block and at least one cold block. Intervals with
+    subranges, defined by a terminator or live into a landing pad are left alone.
+    The two new registers are appended to NewVirtRegs, LI is removed.
+    */
+    bool splitHotCold(LiveInterval &LI, SmallVectorImpl<Register> &NewVirtRegs) {
+        Register Reg = LI.reg();
+        if(!Options.HotColdSplit || !LI.isSpillable() || LI.hasSubRanges() || HotColdSplitRegs.count(Reg)
+           || LIS->intervalIsInOneMBB(LI)) {
+            return false;
+        }
+
+        SmallSetVector<MachineBasicBlock *, 16> Covered;
+        bool CoversCold = false;
+        forEachCoveredBlock(LI, [&](MachineBasicBlock &MBB) {
+            Covered.insert(&MBB);
+            CoversCold |= isColdBlock(MBB);
+            return false;
+        });
+        bool HotReference = any_of(MRI->reg_nodbg_instructions(Reg), [&](const MachineInstr &MI) {
+            return !isColdBlock(*MI.getParent());
+        });
+        bool TerminatorDef = any_of(MRI->def_instructions(Reg), [](const MachineInstr &MI) {
+            return MI.isTerminator();
+        });
+        if(!CoversCold || !HotReference || TerminatorDef) {
+            return false;
+        }
+
+        SmallVector<std::pair<MachineBasicBlock *, MachineBasicBlock *>, 8> Edges;
+        for(MachineBasicBlock *MBB: Covered) {
+            for(MachineBasicBlock *Succ: MBB->successors()) {
+                if(isColdBlock(*MBB) == isColdBlock(*Succ) || !LIS->isLiveInToMBB(LI, Succ)) {
+                    continue;
+                }
+                if(Succ->isEHPad()) {
+                    return false;
+                }
+                Edges.push_back(std::make_pair(MBB, Succ));
+            }
+        }
+
+        LiveRangeEdit LRE(&LI, NewVirtRegs, *MF, *LIS, VRM, this, &DeadRemats);
+        Register HotReg = LRE.createFrom(Reg);
+        Register ColdReg = LRE.createFrom(Reg);
+        HotColdSplitRegs.insert(HotReg);
+        HotColdSplitRegs.insert(ColdReg);
+
+        // Debug values included
+        for(MachineOperand &MO: make_early_inc_range(MRI->reg_operands(Reg))) {
+            MO.setReg(isColdBlock(*MO.getParent()->getParent()) ? ColdReg : HotReg);
+        }
+
+        // Live into a block means live out of each of its predecessors, one copy per block end does.
+        const TargetInstrInfo *TII = MF->getSubtarget().getInstrInfo();
+        SmallPtrSet<MachineBasicBlock *, 8> CopyAtStart;
+        SmallPtrSet<MachineBasicBlock *, 8> CopyAtEnd;
+        for(auto [From, To]: Edges) {
+            MachineBasicBlock *MBB = From;
+            MachineBasicBlock::iterator Pos;
+            if(isColdBlock(*From)) {
+                if(!CopyAtEnd.insert(From).second) {
+                    continue;
+                }
+                Pos = From->getFirstTerminator();
+            } else if(none_of(To->predecessors(), [&](MachineBasicBlock *Pred) { return isColdBlock(*Pred); })) {
+                if(!CopyAtStart.insert(To).second) {
+                    continue;
+                }
+                MBB = To;
+                Pos = To->SkipPHIsLabelsAndDebug(To->begin());
+            } else {
+                if(!CopyAtEnd.insert(From).second) {
+                    continue;
+                }
+                Pos = From->getFirstTerminator();
+            }
+
+            bool ToCold = isColdBlock(*To);
+            MachineInstr *Copy = BuildMI(*MBB, Pos, DebugLoc(), TII->get(TargetOpcode::COPY), ToCold ? ColdReg : HotReg)
+                                     .addReg(ToCold ? HotReg : ColdReg);
+            LIS->InsertMachineInstrInMaps(*Copy);
+        }
+
+        computeSplitInterval(HotReg, LI);
+        computeSplitInterval(ColdReg, LI);
+        LIS->removeInterval(Reg);
+
+        trace() << "Split " << printReg(Reg, TRI) << " by block frequency into " << printReg(HotReg, TRI)
+                << " (hot) and " << printReg(ColdReg, TRI) << " (cold), " << Edges.size() << " edges\n";
+        return true;
+    }
+
+    // True if LI covers a block outside of L other than Preheader.
+    bool isLiveOutsideLoop(const LiveInterval &LI, const MachineLoop &L, const MachineBasicBlock *Preheader) const {
+        return forEachCoveredBlock(LI, [&](MachineBasicBlock &MBB) {
+            return &MBB != Preheader && !L.contains(&MBB);
+        });
+    }
+
+    /*
+    Split a value that is only read inside a loop at the loop preheader, for the
+    LoopNest order:
+
+        %v = ...                        %v = ...
+        loop:                           preheader:
+            ... = use %v        =>          %w = COPY %v
+        ... = use %v                    loop:
+                                            ... = use %w
+                                        ... = use %v
+
+    %w is referenced in the loop only and gets its priority, %v keeps the references
+    outside. Once %w is assigned, %v no longer needs a register inside the loop: it
+    is placed with the code around the loop, or spilled around it.
+
+    The loop is the innermost one around the deepest use of LI that contains no
+    def of it and outside of which LI lives in more than the preheader. Returns
+    false if there is no such loop. Otherwise both registers, and any component
+    of LI that came apart, are queued again.
+    */
+    bool splitAtLoopPreheader(LiveInterval &LI) {
+        Register Reg = LI.reg();
+        const MachineLoop *Innermost = nullptr;
+        for(const MachineInstr &MI: MRI->use_nodbg_instructions(Reg)) {
+            const MachineLoop *L = MLI->getLoopFor(MI.getParent());
+            if(L && (!Innermost || L->getLoopDepth() > Innermost->getLoopDepth())) {
+                Innermost = L;
+            }
+        }
+
+        const MachineLoop *Loop = nullptr;
+        MachineBasicBlock *Preheader = nullptr;
+        for(const MachineLoop *L = Innermost; L; L = L->getParentLoop()) {
+            // A def inside L is inside every loop around it as well.
+            bool DefinedInLoop = any_of(MRI->def_instructions(Reg), [&](const MachineInstr &Def) {
+                return L->contains(Def.getParent());
+            });
+            if(DefinedInLoop) {
+                break;
+            }
+
+            Preheader = L->getLoopPreheader();
+            if(Preheader && LIS->isLiveInToMBB(LI, L->getHeader()) && isLiveOutsideLoop(LI, *L, Preheader)) {
+                Loop = L;
+                break;
+            }
+        }
+        if(!Loop) {
+            return false;
+        }
+
+        SmallVector<Register, 4> NewVirtRegs;
+        LiveRangeEdit LRE(&LI, NewVirtRegs, *MF, *LIS, VRM, this, &DeadRemats);
+        Register LoopReg = LRE.createFrom(Reg);
+
+        // A preheader has the header as its only successor, at most an unconditional branch ends it.
+        const TargetInstrInfo *TII = MF->getSubtarget().getInstrInfo();
+        MachineInstr *Copy = BuildMI(*Preheader, Preheader->getFirstTerminator(), DebugLoc(),
+                                     TII->get(TargetOpcode::COPY), LoopReg).addReg(Reg);
+        LIS->InsertMachineInstrInMaps(*Copy);
+
+        for(MachineOperand &MO: make_early_inc_range(MRI->use_operands(Reg))) {
+            if(MO.getParent() != Copy && Loop->contains(MO.getParent()->getParent())) {
+                MO.setReg(LoopReg);
+            }
+        }
+        computeSplitInterval(LoopReg, LI);
+
+        SmallVector<Register, 4> Requeue = {LoopReg, Reg};
+        shrinkAfterSplit(LI, Requeue);
+
+        trace() << "Split " << printReg(Reg, TRI) << " at the preheader of loop "
+                << printMBBReference(*Loop->getHeader()) << " into " << printReg(LoopReg, TRI) << "\n";
+        for(Register SplitReg: Requeue) {
+            enqueue(SplitReg);
+        }
+        return true;
+    }
+
+    /*
+    A repair keeps its changes to the existing allocation local: it only evicts
+    intervals that live in a single block.
+    */
+    bool isRepairEvictable(const LiveInterval &IntfLI) const {
+        return !Options.Repair || LIS->intervalIsInOneMBB(IntfLI);
+    }
+
+    /*
+    Hand LI over to the spiller. The new virtual registers it creates for the
+    reloads and spills are added to NewVirtRegs.
+    */
+    void spillInterval(const LiveInterval *LI, SmallVectorImpl<Register> &NewVirtRegs, bool Evicted) {
+        Register Reg = LI->reg();
+        Stats.NumSpills++;
+        if(isDumpingIntervals()) {
+            recordDumpSpilled(*LI, Evicted);
+        }
+
+        LiveRangeEdit LRE(LI, NewVirtRegs, *MF, *LIS, VRM, this, &DeadRemats);
+        SpillerInst->spill(LRE);
+
+        if(isDumpingIntervals()) {
+            recordDumpStackSlot(Reg);
+        }
+    }
+
+    /*
+    Physical registers that turn a two-address COPY around LI into an identity copy.
+
+    Many x86 instructions tie their destination to the first source. The two-address
+    pass satisfies the constraint by rewriting
+        %d = ADD32rr %a, %b
+    into
+        %d = COPY %a
+        %d = ADD32rr %d(tied-def), %b
+    If %a dies at the COPY and %d gets the register of %a, the COPY becomes an identity
+    copy and disappears in the rewriter. This works in both directions: when
+    allocating %d, prefer the register of %a, and when allocating %a, prefer the
+    register of %d.
+    */
+    void collectTiedCopyHints(const LiveInterval &LI, SmallVectorImpl<MCRegister> &TiedHints) const {
+        Register Reg = LI.reg();
+        for(const MachineInstr &MI: MRI->reg_nodbg_instructions(Reg)) {
+            if(!MI.isFullCopy()) {
+                continue;
+            }
+
+            Register Dst = MI.getOperand(0).getReg();
+            Register Src = MI.getOperand(1).getReg();
+            if(Dst == Src) {
+                continue;
+            }
+
+            // Only copies feeding a tied use, that is the ones created for two-address instructions
+            bool FeedsTiedUse = any_of(MRI->use_nodbg_operands(Dst), [](const MachineOperand &MO) {
+                return MO.isTied();
+            });
+            if(!Dst.isVirtual() || !FeedsTiedUse) {
+                continue;
+            }
+
+            // The source has to die at the copy, otherwise both values are live after it.
+            if(Src.isVirtual()) {
+                LiveQueryResult SrcQuery = LIS->getInterval(Src).Query(LIS->getInstructionIndex(MI));
+                if(!SrcQuery.isKill()) {
+                    continue;
+                }
+            }
+
+            Register Other = Dst == Reg ? Src : Dst;
+            if(Other.isPhysical()) {
+                TiedHints.push_back(Other.asMCReg());
+            } else if(VRM->hasPhys(Other)) {
+                TiedHints.push_back(VRM->getPhys(Other));
+            }
+        }
+    }
+
+    /*
+    Mark the register units written within Clearance instructions before MI.
+
+    The scan goes back through MI's block, then on into the previous iteration of
+    a single-block loop or into the only predecessor. Writes of already assigned
+    virtual registers and of physical registers count, except the ones by
+    instructions that read no register at all: zeroing idioms and immediate moves
+    (xorps %xmm0, %xmm0 is the pseudo V_SET0 here, xor %eax, %eax is MOV32r0)
+    depend on nothing and end the chain. Only the newest write of a unit matters,
+    older ones are hidden behind it.
+    */
+    void collectRecentWrites(const MachineInstr &MI, unsigned Clearance, BitVector &Units) const {
+        const MachineBasicBlock *MBB = MI.getParent();
+        MachineBasicBlock::const_reverse_iterator It = std::next(MachineBasicBlock::const_reverse_iterator(MI));
+        unsigned Distance = 0;
+        unsigned BlocksLeft = 4;
+        // Units written later than the scan position, the chain of each ends there
+        BitVector Resolved(TRI->getNumRegUnits());
+        while(Distance < Clearance) {
+            if(It == MBB->rend()) {
+                if(!BlocksLeft--) {
+                    break;
+                }
+                if(MBB->pred_size() == 1) {
+                    MBB = *MBB->pred_begin();
+                } else if(!MBB->isSuccessor(MBB)) {
+                    break;
+                }
+                It = MBB->rbegin();
+                continue;
+            }
+
+            const MachineInstr &Prev = *It++;
+            if(Prev.isMetaInstruction()) {
+                continue;
+            }
+            Distance++;
+
+            bool ReadsRegisters = any_of(Prev.operands(), [](const MachineOperand &MO) {
+                return MO.isReg() && MO.getReg() && MO.readsReg();
+            });
+            for(const MachineOperand &MO: Prev.operands()) {
+                if(!MO.isReg() || !MO.isDef() || !MO.getReg()) {
+                    continue;
+                }
+
+                MCRegister PhysReg;
+                if(MO.getReg().isPhysical()) {
+                    PhysReg = MO.getReg().asMCReg();
+                } else if(VRM->hasPhys(MO.getReg())) {
+                    PhysReg = VRM->getPhys(MO.getReg());
+                } else {
+                    continue;
+                }
+                for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+                    if(!Resolved.test(*Unit) && ReadsRegisters) {
+                        Units.set(*Unit);
+                    }
+                    Resolved.set(*Unit);
+                }
+            }
+        }
+    }
+
+    /*
+    getUndefRegClearance of an undef virtual register operand, as it will be once
+    the operand is assigned: asked for a copy of MI with any register of its class
+    in place of the operand. The copy is not in a block, so it is not in the use
+    lists either.
+
+    Limitation: the preference only holds as long as nothing replaces the register
+    after allocation. BreakFalseDeps may still move an undef source to a register
+    the instruction reads anyway, or clear it with a dependency-breaking xor.
     */
-    VirtRegMap *VRM;
+    unsigned getUndefSourceClearance(const MachineInstr &MI, unsigned OpNum) const {
+        const TargetInstrInfo *TII = MF->getSubtarget().getInstrInfo();
+        Register Reg = MI.getOperand(OpNum).getReg();
+        if(!Reg.isVirtual()) {
+            return TII->getUndefRegClearance(MI, OpNum, TRI);
+        }
 
-    /*
-    Physical Register information of the Target Architecture
-    */
-    const TargetRegisterInfo *TRI;
+        const TargetRegisterClass *RC = MRI->getRegClass(Reg);
+        if(!RC->getNumRegs()) {
+            return 0;
+        }
+        MachineInstr *Assigned = MF->CloneMachineInstr(&MI);
+        Assigned->getOperand(OpNum).setReg(RC->getRegister(0));
+        unsigned Clearance = TII->getUndefRegClearance(*Assigned, OpNum, TRI);
+        MF->deleteMachineInstr(Assigned);
+        return Clearance;
+    }
 
     /*
-    "Machine Register Info" or "Machine Register Interface", contains information about Virtual Registers
+    False dependencies: some instructions only write part of their destination, or
+    read a register whose value they ignore, and still wait for its last write.
+    On x86 these are the SSE scalar conversions and square roots, cvtsi2sd,
+    sqrtss, and popcnt, lzcnt and tzcnt on some cores, among others. Inside a loop
+    that wait chains the iterations together.
+
+    The target reports them with TargetInstrInfo::getPartialRegUpdateClearance for
+    destinations and getUndefRegClearance for ignored (undef) sources, together
+    with how many instructions back a write has to be to not matter. For defs and
+    undef uses of LI in blocks at least FalseDependencyMinFrequency times as hot
+    as the entry, collect the units written within that clearance into Units.
+    Returns false if LI has none of them.
+
+    x86 only answers getUndefRegClearance for physical operands, which an undef
+    source is not before allocation: the ignored first source of the AVX forms
+    (vcvtsi2sd, vsqrtss, ...) is a virtual register of its own. See
+    getUndefSourceClearance. The SSE forms tie that source to the destination and
+    are found through getPartialRegUpdateClearance.
     */
-    MachineRegisterInfo *MRI;
+    bool collectFalseDependencyHazards(const LiveInterval &LI, BitVector &Units) const {
+        if(!Options.AvoidFalseDependencies) {
+            return false;
+        }
 
-    // Live Intervals
-    LiveIntervals *LIS;
-    
-    // LiveIntervalQueue: Keeps track of the Valid LiveIntervals which needs assignment.
-    std::queue<LiveInterval *> LIQ;
+        Register Reg = LI.reg();
+        const TargetInstrInfo *TII = MF->getSubtarget().getInstrInfo();
+        bool Found = false;
+        for(const MachineOperand &MO: MRI->reg_nodbg_operands(Reg)) {
+            const MachineInstr &MI = *MO.getParent();
+            if(!(MO.isDef() || MO.isUndef())
+               || MBFI->getBlockFreqRelativeToEntryBlock(MI.getParent()) < Options.FalseDependencyMinFrequency) {
+                continue;
+            }
 
-    // Add LiveInterval LI to Queue
-    void enqueue(LiveInterval *const LI) {
-        outs() << "Adding {Register=" << *LI << "}\n";
-        LIQ.push(LI);
+            unsigned OpNum = MI.getOperandNo(&MO);
+            unsigned Clearance = MO.isDef() ? TII->getPartialRegUpdateClearance(MI, OpNum, TRI)
+                                            : getUndefSourceClearance(MI, OpNum);
+            if(Clearance) {
+                Units.resize(TRI->getNumRegUnits());
+                collectRecentWrites(MI, Clearance, Units);
+                Found = true;
+            }
+        }
+        return Found;
     }
 
-    // Remove LiveInterval LI from the Queue in FIFO manner.
-    LiveInterval* dequeue() {
-        if(LIQ.empty()) {
-            return nullptr;
-        }
-        LiveInterval* LI = LIQ.front();
-        outs() << "Popping {Reg=" << *LI << "}\n";
-        LIQ.pop();
+    bool isColdBlock(const MachineBasicBlock &MBB) const {
+        return MBFI->getBlockFreqRelativeToEntryBlock(&MBB) < Options.ColdBlockFrequency;
+    }
 
-        return LI;
+    // True if LI covers a block that is not cold.
+    bool isOnHotPath(const LiveInterval &LI) const {
+        return forEachCoveredBlock(LI, [&](MachineBasicBlock &MBB) {
+            return !isColdBlock(MBB);
+        });
     }
 
-    /*
-    The LiveRegMatrix class in LLVM tracks virtual register interference along two dimensions: slot indexes and register units.
-    
-    Contains information about the Interferences. This is similar to Interference Graph.
-    
-    The "smallest units of interference" in the context of register allocation refers to register units, which represent 
-    the most granular level at which registers can interfere with each other.
+    void markUnits(MCRegister PhysReg, BitVector &Units) const {
+        for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+            Units.set(*Unit);
+        }
+    }
 
-    For example:
-        1. In x86, there are overlapping registers of different sizes, such as:
-            - AL (8-bit)
-            - AX (16-bit, contains AL)
-            - EAX (32-bit, contains AX)
-            - RAX (64-bit, contains EAX)
-        2. Register units for these might look like:
-            - AL: Unit 1
-            - AH: Unit 2
-            .
-            .
-        In this example, if a virtual register is assigned to AL, it would interfere with any other virtual register assigned to AL, AX, EAX, or RAX, but not with AH.
+    /*
+    Shrink-wrapping can only move the save and restore of a callee-saved register
+    off the fast path of a function, say past an early exit, if the register is not
+    live anywhere on that path. So an interval on the hot path takes a callee-saved
+    register only after the caller-saved ones, unless the hot path uses that
+    register anyway: a fixed operand in a hot block, or an earlier hot interval
+    that got it. Its save then has to stay in the prologue regardless.
+
+    Start the current function: collect the callee-saved units and the ones hot
+    blocks reference.
     */
-    LiveRegMatrix *LRM;
-
-    // Register Class Information
-    RegisterClassInfo RCI;
+    void initCalleeSavedUnits() {
+        CalleeSavedUnits.clear();
+        HotCalleeSavedUnits.clear();
+        if(!Options.HotPathCallerSaved) {
+            return;
+        }
 
-    // Spiller
-    std::unique_ptr<Spiller> SpillerInst;
-    // Track machine instructions that define original registers but become dead after rematerialization.
-    SmallPtrSet<MachineInstr *, 32> DeadRemats;
+        CalleeSavedUnits.resize(TRI->getNumRegUnits());
+        HotCalleeSavedUnits.resize(TRI->getNumRegUnits());
+        for(const MCPhysReg *CSR = MRI->getCalleeSavedRegs(); CSR && *CSR; ++CSR) {
+            markUnits(*CSR, CalleeSavedUnits);
+        }
+        for(const MachineBasicBlock &MBB: *MF) {
+            if(isColdBlock(MBB)) {
+                continue;
+            }
+            for(const MachineInstr &MI: MBB) {
+                for(const MachineOperand &MO: MI.operands()) {
+                    if(MO.isReg() && MO.getReg().isPhysical()) {
+                        markUnits(MO.getReg().asMCReg(), HotCalleeSavedUnits);
+                    }
+                }
+            }
+        }
+        HotCalleeSavedUnits &= CalleeSavedUnits;
+    }
 
+    // A callee-saved register the hot path does not use yet.
+    bool isColdCalleeSaved(MCRegister PhysReg) const {
+        for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+            if(CalleeSavedUnits.test(*Unit) && !HotCalleeSavedUnits.test(*Unit)) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-public:
-    static char ID;
+    /*
+    Move the Preferred registers to the front of Hints, in the order given. Registers
+    outside of the allocation Order of the interval's class are ignored.
+    */
+    static void moveToFront(SmallVectorImpl<MCPhysReg> &Hints, ArrayRef<MCRegister> Preferred,
+                            ArrayRef<MCPhysReg> Order) {
+        SmallVector<MCPhysReg, 16> Ranked;
+        for(MCRegister PhysReg: Preferred) {
+            if(is_contained(Order, PhysReg) && !is_contained(Ranked, PhysReg)) {
+                Ranked.push_back(PhysReg);
+            }
+        }
+        if(Ranked.empty()) {
+            return;
+        }
 
-    StringRef getPassName() const override {
-        return "Minimal Register Allocator";
+        for(MCPhysReg PhysReg: Hints) {
+            if(!is_contained(Ranked, PhysReg)) {
+                Ranked.push_back(PhysReg);
+            }
+        }
+        Hints.assign(Ranked.begin(), Ranked.end());
     }
 
-    RegisterAllocatorMinimal() : MachineFunctionPass(ID) {}
-
     /*
-    Get the requried analysis passes
+    Spill slot size in bytes of a scalar register, or 0 if Reg is not a scalar that
+    could go into one lane of a vector stack slot of VectorBytes.
     */
-    void getAnalysisUsage(AnalysisUsage &AU) const override {
-        MachineFunctionPass::getAnalysisUsage(AU);
-        AU.setPreservesCFG();
-
-#define REQUIRE_AND_PRESERVE_PASS(PassName)                                    \
-  AU.addRequired<PassName>();                                                  \
-  AU.addPreserved<PassName>()
+    unsigned getScalarSpillSize(Register Reg, unsigned VectorBytes) const {
+        const TargetRegisterClass *RC = Reg.isVirtual() ? MRI->getRegClass(Reg)
+                                                        : TRI->getMinimalPhysRegClass(Reg);
+        unsigned Bytes = TRI->getSpillSize(*RC);
+        return (Bytes == 4 || Bytes == 8) && Bytes < VectorBytes ? Bytes : 0;
+    }
 
-        REQUIRE_AND_PRESERVE_PASS(SlotIndexesWrapperPass);
-        REQUIRE_AND_PRESERVE_PASS(VirtRegMap);
-        REQUIRE_AND_PRESERVE_PASS(LiveIntervalsWrapperPass);
-        REQUIRE_AND_PRESERVE_PASS(LiveRegMatrix);
+    /*
+    Reciprocal throughput of MIs issued together: the cycles of the most loaded
+    processor resource, or of the issue width for MIs plus ExtraMicroOps. Unlike
+    the sum of the single instruction throughputs this sees that a vector store
+    and its lane inserts run on different ports.
+    */
+    static double getResourceBound(const TargetSchedModel &SchedModel, ArrayRef<MachineInstr *> MIs,
+                                   unsigned ExtraMicroOps) {
+        const MCSchedModel *Model = SchedModel.getMCSchedModel();
+        SmallVector<double, 32> Cycles(Model->getNumProcResourceKinds(), 0);
+        double MicroOps = ExtraMicroOps;
+        for(MachineInstr *MI: MIs) {
+            const MCSchedClassDesc *SC = SchedModel.resolveSchedClass(MI);
+            if(!SC->isValid()) {
+                continue;
+            }
+            MicroOps += SC->NumMicroOps;
+            for(const MCWriteProcResEntry &Entry: make_range(SchedModel.getWriteProcResBegin(SC),
+                                                             SchedModel.getWriteProcResEnd(SC))) {
+                Cycles[Entry.ProcResourceIdx] += Entry.ReleaseAtCycle;
+            }
+        }
 
-        // implicitly requested by the spiller
-        REQUIRE_AND_PRESERVE_PASS(LiveStacks);
-        REQUIRE_AND_PRESERVE_PASS(AAResultsWrapperPass);
-        REQUIRE_AND_PRESERVE_PASS(MachineDominatorTreeWrapperPass);
-        REQUIRE_AND_PRESERVE_PASS(MachineLoopInfoWrapperPass);
-        REQUIRE_AND_PRESERVE_PASS(MachineBlockFrequencyInfoWrapperPass);
+        double Bound = MicroOps / SchedModel.getIssueWidth();
+        // Index 0 is the invalid resource
+        for(unsigned Idx = 1; Idx < Cycles.size(); Idx++) {
+            Bound = std::max(Bound, Cycles[Idx] / Model->getProcResource(Idx)->NumUnits);
+        }
+        return Bound;
     }
 
     /*
-    Request PHI Nodes are removed before doing Register Allocation
+    A frame index operand that starts an x86 memory reference: base, scale, index,
+    displacement and segment. Spill slot references of any other shape keep their
+    slot out of spill packing.
     */
-    MachineFunctionProperties getRequiredProperties() const override {
-        return MachineFunctionProperties().set(
-            MachineFunctionProperties::Property::NoPHIs
-        );
+    static bool isFrameMemoryReference(const MachineInstr &MI, unsigned OpIdx) {
+        return !MI.isDebugInstr() && OpIdx + 4 < MI.getNumOperands() && MI.getOperand(OpIdx + 1).isImm()
+               && MI.getOperand(OpIdx + 2).isReg() && MI.getOperand(OpIdx + 3).isImm();
+    }
+
+    // Opcode named Name, 0 if the target has none
+    static unsigned findOpcode(const TargetInstrInfo &TII, StringRef Name) {
+        for(unsigned Opcode = 0; Opcode < TII.getNumOpcodes(); Opcode++) {
+            if(TII.getName(Opcode) == Name) {
+                return Opcode;
+            }
+        }
+        return 0;
     }
 
     /*
-    Get the Register Units for the Physical Register. Collect the Interfering
-    VirtRegs. 
-    Only if all the Reg Units are spillable, and their spill cost is less than the
-    current LI for which we are trying to assign PhysReg, then we spill those
-    virtRegs(IntfLI)
+    Spill packing, x86-64 only.
+
+    Scalar FP spills emitted close to each other share one 16-byte stack slot: the
+    values are inserted into the lanes of a scratch vector register, which is
+    stored with one vector move.
+
+        MOVSDmr %stack.0, %a                    %v = COPY %a
+        ...                             =>      ...
+        MOVSDmr %stack.1, %b                    %t = COPY %b
+                                                %v = UNPCKLPDrr %v, %t
+                                                MOVAPSmr %stack.2, %v
+
+    Every other reference to %stack.0 and %stack.1, reloads and folded operands,
+    is moved to its lane of %stack.2 by displacement: reloads stay scalar loads.
+    %stack.0 and %stack.1 are removed from the frame.
+
+    A group is up to SpillPackingWindow instructions apart per store, in one block,
+    with no other reference to its slots in between. It is packed when the resource
+    bound (see getResourceBound) of the inserts and the vector store is lower than
+    the one of the scalar stores. %t takes the register of %b, so its COPY goes
+    away, and %v gets a register that is free over the whole group, the one of %a
+    if possible.
+
+    Only 128-bit slots and FP scalars are formed. Under the resource bound:
+        - a 256-bit slot needs the same inserts plus a vinsertf128 and a second
+          scratch register, and loses to two 128-bit slots
+        - a general purpose register needs a move into the vector file per lane on
+          top of the insert, which costs more than the store it saves
+        - a vector reload plus lane extracts costs more than the scalar reloads
+    Functions with debug info are left alone: the debug values of spilled
+    registers are placed by the stack slot of the VirtRegMap, which cannot be moved.
     */
-    bool spillInterferences(LiveInterval *const LI, MCRegister PhysReg, SmallVectorImpl<Register> *const SplitVirtRegs) {
-        SmallVector<const LiveInterval *, 8> IntfLIs;
+    void packSpills() {
+        const TargetSubtargetInfo &STI = MF->getSubtarget();
+        const TargetInstrInfo *TII = STI.getInstrInfo();
+        MachineFrameInfo &MFI = MF->getFrameInfo();
+        if(MF->getTarget().getTargetTriple().getArch() != Triple::x86_64 || MF->getFunction().getSubprogram()) {
+            return;
+        }
 
-        for(MCRegUnitIterator RegUnit(PhysReg, TRI); RegUnit.isValid(); RegUnit++) {
-            LiveIntervalUnion::Query &Q = LRM->query(*LI, *RegUnit);
-            for (const LiveInterval *const IntfLI: Q.interferingVRegs()) {
-                if(!IntfLI->isSpillable() || IntfLI->weight() > LI->weight()) {
-                    return false;
-                }
+        TargetSchedModel SchedModel;
+        SchedModel.init(&STI);
+        if(!SchedModel.hasInstrSchedModel()) {
+            return;
+        }
+
+        // VEX encodings with AVX, no SSE/AVX transition. 4-byte lanes need insertps (SSE4.1).
+        bool HasAVX = STI.checkFeatures("+avx");
+        unsigned InsertF64 = findOpcode(*TII, HasAVX ? "VUNPCKLPDrr" : "UNPCKLPDrr");
+        unsigned InsertF32 = STI.checkFeatures("+sse4.1") ? findOpcode(*TII, HasAVX ? "VINSERTPSrr" : "INSERTPSrr")
+                                                          : 0;
+        if(!InsertF64) {
+            return;
+        }
+        const TargetRegisterClass *VectorRC = TII->getRegClass(TII->get(InsertF64), 0, TRI, *MF);
 
-                IntfLIs.push_back(IntfLI);
+        /*
+        Spill slots every reference of which is a memory reference the displacement
+        can be moved in.
+        */
+        DenseMap<int, bool> Movable;
+        for(MachineBasicBlock &MBB: *MF) {
+            for(MachineInstr &MI: MBB) {
+                for(unsigned OpIdx = 0; OpIdx < MI.getNumOperands(); OpIdx++) {
+                    const MachineOperand &MO = MI.getOperand(OpIdx);
+                    if(MO.isFI() && MFI.isSpillSlotObjectIndex(MO.getIndex())) {
+                        auto [It, Inserted] = Movable.try_emplace(MO.getIndex(), true);
+                        It->second &= isFrameMemoryReference(MI, OpIdx);
+                    }
+                }
             }
         }
 
-        // Spill each interfering vreg allocated to PhysRegs.
-        for(unsigned IntfIdx = 0; IntfIdx < IntfLIs.size(); IntfIdx++) {
-            const LiveInterval *const LIToSpill = IntfLIs[IntfIdx];
+        struct Lane {
+            int Slot;
+            unsigned Offset;
+        };
+        DenseMap<int, Lane> Packed;
+
+        auto referencesAny = [](const MachineInstr &MI, ArrayRef<int> Slots) {
+            return any_of(MI.operands(), [&](const MachineOperand &MO) {
+                return MO.isFI() && is_contained(Slots, MO.getIndex());
+            });
+        };
+
+        // Pack one group of stores, all in one block, in order. Returns false if it does not pay off.
+        auto packGroup = [&](ArrayRef<MachineInstr *> Stores, ArrayRef<int> Slots, unsigned Bytes) {
+            MachineBasicBlock &MBB = *Stores.front()->getParent();
+            SmallVector<Register, 4> Values;
+            for(MachineInstr *Store: Stores) {
+                int FrameIdx;
+                Values.push_back(TII->isStoreToStackSlot(*Store, FrameIdx));
+            }
 
-            /*
-            Avoid duplicates
+            // Scratch register over the group, the one of the first value first
+            Register Scratch = MRI->createVirtualRegister(VectorRC);
+            LiveInterval &Range = LIS->createEmptyInterval(Scratch);
+            SlotIndex Start = LIS->getInstructionIndex(*Stores.front()).getRegSlot();
+            SlotIndex End = LIS->getInstructionIndex(*Stores.back()).getRegSlot();
+            Range.addSegment(LiveRange::Segment(Start, End, Range.getNextValue(Start, LIS->getVNInfoAllocator())));
 
-            This check ensures that we only process virtual registers (LIToSpill) that are 
-            currently assigned to physical registers by the VirtRegMap (VRM)
+            /*
+            A query caches its answer per interval address and matrix state. Range
+            reuses the memory of a rejected group's, with nothing assigned since.
             */
-            if(!VRM->hasPhys(LIToSpill->reg())) {
-                continue;
+            LRM->invalidateVirtRegs();
+            MCRegister ScratchPhys;
+            SmallVector<MCPhysReg, 16> Candidates = {MCPhysReg(VRM->getPhys(Values.front()))};
+            append_range(Candidates, RCI.getOrder(VectorRC));
+            for(MCPhysReg PhysReg: Candidates) {
+                if(VectorRC->contains(PhysReg) && LRM->checkInterference(Range, PhysReg) == LiveRegMatrix::IK_Free) {
+                    ScratchPhys = PhysReg;
+                    break;
+                }
+            }
+            LIS->removeInterval(Scratch);
+            if(!ScratchPhys) {
+                return false;
             }
 
-            LRM->unassign(*LIToSpill);
-            LiveRangeEdit LRE(LIToSpill, *SplitVirtRegs, *MF, *LIS, VRM, this,
-                        &DeadRemats);
-             SpillerInst->spill(LRE);
-        }
+            // Build the packed sequence, outside of the slot indexes until it is known to pay off
+            int VectorSlot = MFI.CreateSpillStackObject(16, Align(16));
+            SmallVector<MachineInstr *, 8> NewMIs;
+            SmallVector<MachineInstr *, 8> Costed;
+            SmallVector<Register, 4> LaneRegs;
+            NewMIs.push_back(BuildMI(MBB, Stores.front()->getIterator(), DebugLoc(), TII->get(TargetOpcode::COPY),
+                                     Scratch).addReg(Values.front()));
+            for(unsigned Idx = 1; Idx < Stores.size(); Idx++) {
+                Register LaneReg = MRI->createVirtualRegister(VectorRC);
+                LaneRegs.push_back(LaneReg);
+                MachineBasicBlock::iterator Pos = Stores[Idx]->getIterator();
+                NewMIs.push_back(BuildMI(MBB, Pos, DebugLoc(), TII->get(TargetOpcode::COPY), LaneReg)
+                                     .addReg(Values[Idx]));
+                MachineInstrBuilder Insert = BuildMI(MBB, Pos, DebugLoc(), TII->get(Bytes == 8 ? InsertF64 : InsertF32),
+                                                     Scratch).addReg(Scratch).addReg(LaneReg);
+                if(Bytes == 4) {
+                    Insert.addImm(Idx << 4);
+                }
+                NewMIs.push_back(Insert);
+                Costed.push_back(Insert);
+            }
+            TII->storeRegToStackSlot(MBB, Stores.back()->getIterator(), Scratch, /*isKill=*/true, VectorSlot, VectorRC,
+                                     TRI, Register());
+            NewMIs.push_back(&*std::prev(Stores.back()->getIterator()));
+            Costed.push_back(NewMIs.back());
+
+            // Lane 0 moves between registers unless the scratch register is the one of the first value
+            bool FirstLaneMove = ScratchPhys != VRM->getPhys(Values.front());
+            double PackedCost = getResourceBound(SchedModel, Costed, FirstLaneMove ? 1 : 0);
+            double ScalarCost = getResourceBound(SchedModel, Stores, 0);
+            if(PackedCost >= ScalarCost) {
+                for(MachineInstr *MI: NewMIs) {
+                    MI->eraseFromParent();
+                }
+                MFI.RemoveStackObject(VectorSlot);
+                return false;
+            }
 
-        return true;
-    }
+            // The values now end at their COPY, recompute them around the change.
+            SmallVector<MCRegister, 4> ValuePhys;
+            for(Register Value: Values) {
+                ValuePhys.push_back(VRM->getPhys(Value));
+                LRM->unassign(LIS->getInterval(Value));
+            }
+            for(MachineInstr *MI: NewMIs) {
+                LIS->InsertMachineInstrInMaps(*MI);
+            }
+            for(MachineInstr *Store: Stores) {
+                LIS->RemoveMachineInstrFromMaps(*Store);
+                Store->eraseFromParent();
+            }
+            VRM->grow();
+            for(unsigned Idx = 0; Idx < Values.size(); Idx++) {
+                LIS->removeInterval(Values[Idx]);
+                LRM->assign(LIS->createAndComputeVirtRegInterval(Values[Idx]), ValuePhys[Idx]);
+            }
+            // Free of interference: each value after the first dies at its store (see the grouping below).
+            for(unsigned Idx = 0; Idx < LaneRegs.size(); Idx++) {
+                LRM->assign(LIS->createAndComputeVirtRegInterval(LaneRegs[Idx]), ValuePhys[Idx + 1]);
+            }
+            LRM->assign(LIS->createAndComputeVirtRegInterval(Scratch), ScratchPhys);
+
+            for(unsigned Idx = 0; Idx < Slots.size(); Idx++) {
+                Packed[Slots[Idx]] = {VectorSlot, Idx * Bytes};
+            }
+            NumPackedSpillGroups++;
+            NumPackedSpillStores += Stores.size() - 1;
+            trace() << "Packed " << Stores.size() << " " << Bytes << "-byte spills in " << printMBBReference(MBB)
+                    << " into one vector store, cost " << format("%.2f", ScalarCost) << " -> "
+                    << format("%.2f", PackedCost) << "\n";
+            return true;
+        };
+
+        for(MachineBasicBlock &MBB: *MF) {
+            struct Group {
+                SmallVector<MachineInstr *, 4> Stores;
+                SmallVector<int, 4> Slots;
+                unsigned Bytes = 0;
+            };
+            SmallVector<Group, 4> Groups;
+            Group Current;
+            unsigned Gap = 0;
+
+            auto closeGroup = [&]() {
+                if(Current.Stores.size() > 1) {
+                    Groups.push_back(std::move(Current));
+                }
+                Current = Group();
+            };
+
+            for(MachineInstr &MI: MBB) {
+                if(MI.isDebugInstr()) {
+                    continue;
+                }
+
+                int FrameIdx = 0;
+                Register Reg = TII->isStoreToStackSlot(MI, FrameIdx);
+                unsigned Bytes = 0;
+                if(Reg.isVirtual() && VRM->hasPhys(Reg) && VectorRC->contains(VRM->getPhys(Reg))
+                   && MFI.isSpillSlotObjectIndex(FrameIdx) && Movable.lookup(FrameIdx)) {
+                    Bytes = getScalarSpillSize(Reg, 16);
+                }
+                if(Bytes == 4 && !InsertF32) {
+                    Bytes = 0;
+                }
+                /*
+                The lane copy of a value after the first takes the value's register, which is
+                only free if the value dies at its store. A value that lives on can only
+                start a group.
+                */
+                bool Dies = Bytes && !LIS->getInterval(Reg).liveAt(LIS->getInstructionIndex(MI).getRegSlot());
+
+                if(!Bytes) {
+                    if(!Current.Stores.empty()
+                       && (++Gap > Options.SpillPackingWindow || referencesAny(MI, Current.Slots))) {
+                        closeGroup();
+                    }
+                    continue;
+                }
+
+                if(!Current.Stores.empty() && (Bytes != Current.Bytes || is_contained(Current.Slots, FrameIdx)
+                                               || (Current.Stores.size() + 1) * Bytes > 16 || !Dies)) {
+                    closeGroup();
+                }
+                Current.Bytes = Bytes;
+                Current.Stores.push_back(&MI);
+                Current.Slots.push_back(FrameIdx);
+                Gap = 0;
+            }
+            closeGroup();
 
+            // A slot has one lane, in the first group that packed it.
+            for(const Group &G: Groups) {
+                if(none_of(G.Slots, [&](int Slot) { return Packed.count(Slot); })) {
+                    packGroup(G.Stores, G.Slots, G.Bytes);
+                }
+            }
+        }
+
+        // Move every other reference of a packed slot to its lane.
+        for(MachineBasicBlock &MBB: *MF) {
+            for(MachineInstr &MI: MBB) {
+                for(unsigned OpIdx = 0; OpIdx < MI.getNumOperands(); OpIdx++) {
+                    MachineOperand &MO = MI.getOperand(OpIdx);
+                    auto It = MO.isFI() ? Packed.find(MO.getIndex()) : Packed.end();
+                    if(It == Packed.end()) {
+                        continue;
+                    }
+                    MO.setIndex(It->second.Slot);
+                    MachineOperand &Disp = MI.getOperand(OpIdx + 3);
+                    Disp.setImm(Disp.getImm() + It->second.Offset);
+                }
 
+                SmallVector<MachineMemOperand *, 2> MemOperands;
+                bool Changed = false;
+                for(MachineMemOperand *MMO: MI.memoperands()) {
+                    const auto *Stack = dyn_cast_or_null<FixedStackPseudoSourceValue>(MMO->getPseudoValue());
+                    auto It = Stack ? Packed.find(Stack->getFrameIndex()) : Packed.end();
+                    if(It == Packed.end()) {
+                        MemOperands.push_back(MMO);
+                        continue;
+                    }
+                    unsigned Offset = It->second.Offset + MMO->getOffset();
+                    MemOperands.push_back(MF->getMachineMemOperand(
+                        MachinePointerInfo::getFixedStack(*MF, It->second.Slot, Offset), MMO->getFlags(),
+                        MMO->getSize(), commonAlignment(Align(16), Offset)));
+                    Changed = true;
+                }
+                if(Changed) {
+                    MI.setMemRefs(*MF, MemOperands);
+                }
+            }
+        }
 
+        // Nothing references the scalar slots any more, give their frame space back.
+        for(const auto &[Slot, Lane]: Packed) {
+            MFI.RemoveStackObject(Slot);
+        }
+    }
 
     /*
     Either assign a Physical Register to the Live Interval or split into mutliple Live Interval.
@@ -223,6 +2211,7 @@ public:
 
         */
         bool IsHardHint = TRI->getRegAllocationHints(LI->reg(), Order, Hints, *MF, VRM, LRM);
+        SmallVector<MCPhysReg, 8> HintRegs(Hints.begin(), Hints.end());
         /*
         Get a list of 'hint' registers that the register allocator should try first when allocating a physical register for the virtual register VirtReg.
         These registers are effectively moved to the front of the allocation order.
@@ -235,20 +2224,92 @@ public:
             }
         }
 
-        outs() << "Hint Registers: [";
-        for (const MCPhysReg &PhysReg : Hints) {
-            outs() << TRI->getRegAsmName(PhysReg) << ", ";
+        /*
+        Registers that make a two-address COPY an identity copy come right after the
+        simple hint (see collectTiedCopyHints). They matter more than the other copy
+        hints: the copy sits right in front of the arithmetic instruction, usually
+        inside a loop. The simple hint stays first, targets use it for fixed
+        registers such as the argument and return registers around calls. Hard hints
+        are all the target allows, nothing is added to them.
+        */
+        if(!IsHardHint) {
+            SmallVector<MCRegister, 4> TiedHints;
+            collectTiedCopyHints(*LI, TiedHints);
+            if(!TiedHints.empty()) {
+                Register SimpleHint = MRI->getSimpleHint(LI->reg());
+                if(SimpleHint.isVirtual() && VRM->hasPhys(SimpleHint)) {
+                    SimpleHint = VRM->getPhys(SimpleHint);
+                }
+                if(SimpleHint.isPhysical()) {
+                    TiedHints.insert(TiedHints.begin(), SimpleHint.asMCReg());
+                }
             }
-        outs() << "]\n";
+            moveToFront(Hints, TiedHints, Order);
+            append_range(HintRegs, TiedHints);
+        }
+
+        /*
+        Registers written shortly before an instruction with a false dependency on LI
+        go to the back (see collectFalseDependencyHazards), the order among the others
+        stays as it is.
+        */
+        BitVector HazardUnits;
+        if(collectFalseDependencyHazards(*LI, HazardUnits)) {
+            std::stable_partition(Hints.begin(), Hints.end(), [&](MCPhysReg PhysReg) {
+                for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+                    if(HazardUnits.test(*Unit)) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+        }
+
+        /*
+        Intervals on the hot path try caller-saved registers before callee-saved ones
+        the hot path does not use yet (see initCalleeSavedUnits). An interval that
+        crosses a call still ends up in a callee-saved register, the register mask
+        rules out the others. The hints in front keep their place: a copy or tied
+        hint saves an instruction, which a caller-saved register does not make up for.
+        */
+        if(Options.HotPathCallerSaved && isOnHotPath(*LI)) {
+            auto Tail = find_if_not(Hints, [&](MCPhysReg PhysReg) { return is_contained(HintRegs, PhysReg); });
+            std::stable_partition(Tail, Hints.end(), [&](MCPhysReg PhysReg) {
+                return !isColdCalleeSaved(PhysReg);
+            });
+        }
+
+        trace() << "Hint Registers: [";
+        for (const MCPhysReg &PhysReg : Hints) {
+            trace() << TRI->getRegAsmName(PhysReg) << ", ";
+        }
+        trace() << "]\n";
+
+        /*
+        The first candidate the occupancy kernel proves free ends the scan. Only the
+        candidates in front of it need the LiveRegMatrix, one of them might be free
+        as well and the allocation order has to be kept.
+        */
+        BitVector RegMaskUsable;
+        LIS->checkRegMaskInterference(*LI, RegMaskUsable);
+        size_t Untouched = Occupancy->findUntouched(Hints, RegMaskUsable);
 
         // Spill Candidates
         SmallVector<MCRegister, 8> PhysRegSpillCandidates;
-        for(MCRegister PhyReg: Hints) {
+        for(MCRegister PhyReg: ArrayRef<MCPhysReg>(Hints).take_front(Untouched)) {
             // 2.2 Check for interference
-            switch(LRM->checkInterference(*LI, PhyReg)) {
+            LiveRegMatrix::InterferenceKind Interference = LRM->checkInterference(*LI, PhyReg);
+            if(ReportChurn) {
+                SmallVector<const LiveInterval *, 8> IntfLIs;
+                if(Interference != LiveRegMatrix::IK_Free) {
+                    collectInterferingVRegs(*LI, PhyReg, IntfLIs);
+                }
+                Churn.InterferenceDegree.add(IntfLIs.size());
+            }
+            switch(Interference) {
                 case LiveRegMatrix::IK_Free:
                 // Allocate the first non-infereing (available) register
-                outs() << "Assigning the Physical register: " << TRI->getRegAsmName(PhyReg) << "\n";
+                trace() << "Assigning the Physical register: " << TRI->getRegAsmName(PhyReg) << "\n";
                 return PhyReg;
 
                 case LiveRegMatrix::IK_VirtReg:
@@ -261,10 +2322,36 @@ public:
                 continue;
             }
         }
+        if(Untouched < Hints.size()) {
+            trace() << "Assigning the Physical register: " << TRI->getRegAsmName(Hints[Untouched]) << "\n";
+            return Hints[Untouched];
+        }
 
-        // 2.3. Attempt to spill another interfering reg with less spill weight.
-        for(MCRegister PhysReg: PhysRegSpillCandidates) {
+        /*
+        2.3. Attempt to spill another interfering reg with less spill weight.
 
+        Block-local pressure is settled by furthest next use in both tiers (see
+        chooseByNextUse), spill weights do not matter there. Otherwise only the Full
+        tier evicts. The Fast tier never revisits any other assignment, it goes
+        straight to spilling the current interval. A repair evicts within its budget
+        (see isRepairEvictable).
+        */
+        MCRegister Victim;
+        SmallVector<const LiveInterval *, 4> Evictees;
+        if(!Options.Repair && chooseByNextUse(*LI, PhysRegSpillCandidates, Victim, Evictees)) {
+            if(Victim) {
+                evictInterferences(Evictees, *SplitVirtRegs);
+                trace() << "Evicted the interferences used furthest away: " << TRI->getRegAsmName(Victim) << "\n";
+                return Victim;
+            }
+            trace() << "Spilling the interval used furthest away\n";
+        } else if(Tier == RegAllocMinimalTier::Full || Options.Repair) {
+            for(MCRegister PhysReg: PhysRegSpillCandidates) {
+                if(spillInterferences(LI, PhysReg, SplitVirtRegs)) {
+                    trace() << "Evicted the interferences of: " << TRI->getRegAsmName(PhysReg) << "\n";
+                    return PhysReg;
+                }
+            }
         }
 
         /*
@@ -274,9 +2361,35 @@ public:
 
         2.4 Then we just the current Live Interval and notify the Caller that the passed virtual register 
         has been spilled.
+
+        A repair cannot take back enough of the existing allocation to place an
+        unspillable interval. It asks for a full allocation. The stats handler only
+        sees that after the rewriter ran, so the compile is failed right here, the
+        way other allocators fail when they run out of registers. The interval gets
+        the first register of its order, outside of the LiveRegMatrix, to keep the
+        MIR well-formed until the pipeline ends.
         */
-        LiveRangeEdit LRE(LI, *SplitVirtRegs, *MF, *LIS, VRM, this, &DeadRemats);
-        SpillerInst->spill(LRE);
+        if(Options.Repair && !LI->isSpillable()) {
+            trace() << "No register for unspillable interval, full allocation required\n";
+            Stats.NeedsFullRerun = true;
+            MF->getFunction().getContext().emitError(Twine("regallominimal: repair found no register for %")
+                                                     + Twine(Register::virtReg2Index(LI->reg())) + " in "
+                                                     + MF->getName() + ", a full allocation is required");
+            if(!Order.empty()) {
+                VRM->assignVirt2Phys(LI->reg(), Order.front());
+            }
+            return 0;
+        }
+
+        // Across blocks: give up the register only in the cold ones.
+        if(Tier == RegAllocMinimalTier::Full && !Options.Repair && splitHotCold(*LI, *SplitVirtRegs)) {
+            return 0;
+        }
+        // Long blocks: give up the register only where the references are sparse.
+        if(Tier == RegAllocMinimalTier::Full && !Options.Repair && splitAtUseGap(*LI, *SplitVirtRegs)) {
+            return 0;
+        }
+        spillInterval(LI, *SplitVirtRegs, /*Evicted=*/false);
 
         return 0;
     }
@@ -300,21 +2413,27 @@ public:
 
     bool runOnMachineFunction(MachineFunction &MF) override {
         this->MF = &MF;
+        Tier = getFunctionTier(MF);
+        Stats = RegAllocMinimalStats();
+        auto Start = std::chrono::steady_clock::now();
 
-        outs() << "************************************************\n"
-               << "* Machine Function\n"
-               << "************************************************\n";
+        trace() << "************************************************\n"
+                << "* Machine Function: " << MF.getName()
+                << (Options.Repair ? " (repair)" : Tier == RegAllocMinimalTier::Fast ? " (fast tier)" : "") << "\n"
+                << "************************************************\n";
 
         // 0. Get all the Analysis from the Passes
 
         // Get Analysis from SlotIndex Pass
         SI = &getAnalysis<SlotIndexesWrapperPass>().getSI();
 
-        for (const MachineBasicBlock &MBB: MF) {
-            MBB.print(outs(), SI);
-            outs() << "\n";
+        if(TraceAllocation) {
+            for (const MachineBasicBlock &MBB: MF) {
+                MBB.print(trace(), SI);
+                trace() << "\n";
+            }
+            trace() << "\n\n";
         }
-        outs() << "\n\n";
 
         /* 
         Get Analysis from the 
@@ -344,9 +2463,25 @@ public:
         // register classes. We will be leveraging it to obtain a plausible
         // allocation order of physical registers.
         RCI.runOnMachineFunction(MF);
+        Occupancy = regalloc::createUnitOccupancy(MF, Options.GenericUnitKernel);
+        Occupancy->reset(MF);
 
+        MBFI = &getAnalysis<MachineBlockFrequencyInfoWrapperPass>().getMBFI();
+        MLI = &getAnalysis<MachineLoopInfoWrapperPass>().getLI();
+        VRAI = std::make_unique<VirtRegAuxInfo>(MF, *LIS, *VRM, *MLI, *MBFI);
+        initCalleeSavedUnits();
+        SpillerInst.reset(createInlineSpiller(*this, MF, *VRM, *VRAI));
 
-        // 1. Get Valid Virtual Registers and enqueue them
+        if(ExportInterferenceGraph != GraphFormat::None) {
+            buildInterferenceGraph();
+        }
+
+        /*
+        1. Get Valid Virtual Registers and enqueue them
+
+        Only the cheap queue key is computed here. The LiveInterval is fetched and its
+        spill weight calculated when the register is dequeued.
+        */
         for(unsigned virtualRegIdx = 0; virtualRegIdx < MRI->getNumVirtRegs(); virtualRegIdx++) {
             Register Reg = Register::index2VirtReg(virtualRegIdx);
 
@@ -357,17 +2492,37 @@ public:
             if(MRI->reg_nodbg_empty(Reg)) {
                 continue;
             }
+            // A repair keeps every existing assignment
+            if(Options.Repair && VRM->hasPhys(Reg)) {
+                Occupancy->markAssigned(VRM->getPhys(Reg));
+                continue;
+            }
             
-            enqueue(&LIS->getInterval(Reg));
+            enqueue(Reg);
+            Stats.NumVirtRegs++;
         }
 
 
-        while(LiveInterval *const LI = dequeue()) {
+        while(Register Reg = dequeue()) {
             // Check again the VirtReg is used in non-debug instructions also, else just continue
-            if(MRI->reg_nodbg_empty(LI->reg())) {
-                LIS->removeInterval(LI->reg());
+            if(MRI->reg_nodbg_empty(Reg)) {
+                if(LIS->hasInterval(Reg)) {
+                    LIS->removeInterval(Reg);
+                }
+                continue;
+            }
+
+            LiveInterval *const LI = &LIS->getInterval(Reg);
+            if(Options.Order == RegAllocMinimalOrder::LoopNest && Tier == RegAllocMinimalTier::Full
+               && !Options.Repair && splitAtLoopPreheader(*LI)) {
                 continue;
             }
+            VRAI->calculateSpillWeightAndHint(*LI);
+            recordDequeued(*LI);
+            if(isDumpingIntervals()) {
+                recordDumpDequeued(*LI);
+            }
+            trace() << "Allocating {Reg=" << *LI << "}\n";
 
             /*
             invalidate cached interference information, we need to obtain the interference info again
@@ -383,20 +2538,30 @@ public:
             // Assign the Register
             if(PhysReg) {
                 LRM->assign(*LI, PhysReg);
+                Occupancy->markAssigned(PhysReg);
+                if(Options.HotPathCallerSaved && isColdCalleeSaved(PhysReg) && isOnHotPath(*LI)) {
+                    markUnits(PhysReg, HotCalleeSavedUnits);
+                    HotCalleeSavedUnits &= CalleeSavedUnits;
+                }
+                Stats.NumAssignments++;
+                if(isDumpingIntervals()) {
+                    recordDumpAssigned(Reg, PhysReg);
+                }
             }
 
             // Enqueue the splitted live ranges if any 
-            for(Register Reg: SplitVirtualRegister) {
-                LiveInterval *LI = &LIS->getInterval(Reg);
-                if (MRI->reg_nodbg_empty(LI->reg())) {
-                    LIS->removeInterval(LI->reg());
+            for(Register SplitReg: SplitVirtualRegister) {
+                if (MRI->reg_nodbg_empty(SplitReg)) {
+                    LIS->removeInterval(SplitReg);
                     continue;
                 }
                 
-                enqueue(LI);
+                enqueue(SplitReg);
             }
         }
 
+        SpillerInst->postOptimization();
+
         /* 
         Remove the Dead Machine Instructions
         */
@@ -405,6 +2570,31 @@ public:
             DeadInst->removeFromParent();
         }
         DeadRemats.clear();
+
+        if(Options.SpillPacking) {
+            packSpills();
+        }
+        if(ReportChurn) {
+            reportChurn();
+        }
+        Churn.clear();
+        UsePositions.clear();
+        HotColdSplitRegs.clear();
+        if(isDumpingIntervals()) {
+            writeIntervalDump();
+            Dump.clear();
+        }
+        if(ExportInterferenceGraph != GraphFormat::None) {
+            writeInterferenceGraph();
+            Graph.clear();
+        }
+
+        Stats.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        if(StatsHandler) {
+            StatsHandler(MF, Stats);
+        }
+
+        flushTrace();
         return true;
     }
 };
@@ -431,9 +2621,27 @@ Parameters
 llc -regalloc=register-allocator-minimal input.bc
 
 Note: This just register the customer register allocator
+
+"register-allocator-minimal-fast" registers the same allocator running at the
+Fast tier (no eviction), for compiles where allocation time matters more than
+code quality.
 */
 static RegisterRegAlloc X("register-allocator-minimal", "Minimal Register Allocator", 
-[]() -> FunctionPass* {return new RegisterAllocatorMinimal();});
+[]() -> FunctionPass* {return new RegisterAllocatorMinimal(RegisterAllocatorMinimal::getCommandLineOptions());});
+
+static RegisterRegAlloc XFast("register-allocator-minimal-fast", "Minimal Register Allocator (fast tier)",
+[]() -> FunctionPass* {
+    return new RegisterAllocatorMinimal(RegisterAllocatorMinimal::getCommandLineOptions(RegAllocMinimalTier::Fast));
+});
+}
+
+FunctionPass *llvm::createRegisterAllocatorMinimal(RegAllocMinimalTier Tier) {
+    return new RegisterAllocatorMinimal(RegisterAllocatorMinimal::getCommandLineOptions(Tier));
+}
+
+FunctionPass *llvm::createRegisterAllocatorMinimal(const RegAllocMinimalOptions &Options,
+                                                   RegAllocMinimalStatsHandler StatsHandler) {
+    return new RegisterAllocatorMinimal(Options, std::move(StatsHandler));
 }
 
 /*
@@ -455,3 +2663,12 @@ INITIALIZE_PASS_DEPENDENCY(MachineBlockFrequencyInfoWrapperPass);
 INITIALIZE_PASS_END(RegisterAllocatorMinimal, "regallominimal", "Minimal Register Allocator",
                     false, false)
 
+/*
+The constructor registers the pass as well, but -stop-before=regallominimal and
+-print-after=regallominimal are resolved when the codegen pipeline is set up,
+before the allocator is created. Register it when the library is loaded.
+*/
+static const bool RegisterAllocatorMinimalRegistered = []() {
+    initializeRegisterAllocatorMinimalPass(*PassRegistry::getPassRegistry());
+    return true;
+}();
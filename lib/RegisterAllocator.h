@@ -0,0 +1,158 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_H
+#define REGISTER_ALLOCATOR_MINIMAL_H
+
+#include <llvm/ADT/StringRef.h>
+
+#include "functional"
+
+namespace llvm {
+
+class FunctionPass;
+class MachineFunction;
+
+/*
+Allocation tiers of the Minimal Register Allocator.
+
+    Fast:
+        Assigns the first free register of the allocation order and spills the
+        interval otherwise. The only assignments it takes back are block-local
+        ones whose next use is further away than the interval's, which keeps
+        allocation time low. Meant for tier-0 JIT compiles.
+
+    Full:
+        Additionally evicts lighter interfering intervals before giving up and
+        spilling. Meant for ahead-of-time compiles and hot JIT recompiles.
+*/
+enum class RegAllocMinimalTier {
+    Fast,
+    Full
+};
+
+/*
+Function attribute selecting the tier of a single function, with the values
+"fast" or "full". It overrides the tier the pass was created with.
+
+A JIT can tag functions on the way into its compile layer: "fast" for the first
+compile and "full" once the function got hot and is recompiled, without having
+to build a different codegen pipeline for each tier.
+*/
+constexpr StringRef RegAllocMinimalTierAttr = "regalloc-minimal-tier";
+
+/*
+Order in which virtual registers are taken from the allocation queue.
+
+    BlockSpan:
+        Registers referenced over the longest stretch of blocks first, then the
+        ones with the most references.
+
+    LoopNest:
+        Region by region: registers referenced in the deepest loops first, among
+        those the ones in the hottest blocks, then outer loops, then straight-line
+        code. A value that is only read in a loop and also lives outside of it is
+        split at the loop preheader, so the copy in the loop competes with the loop
+        and the rest with the code around it.
+*/
+enum class RegAllocMinimalOrder {
+    BlockSpan,
+    LoopNest
+};
+
+/*
+Options of one allocator instance. The registered allocators take them from the
+-regalloc-minimal-* command line options, embedders set them directly and leave
+the process wide command line alone.
+
+The diagnostic outputs are not options of an instance and are read from the
+command line by every instance: -regalloc-minimal-trace, -regalloc-minimal-churn-stats,
+-regalloc-minimal-dump-dir, -regalloc-minimal-export-graph, -regalloc-minimal-graph-dir
+and -regalloc-minimal-graph-hottest-loop. They default to off.
+*/
+struct RegAllocMinimalOptions {
+    RegAllocMinimalTier Tier = RegAllocMinimalTier::Full;
+
+    // Let RegAllocMinimalTierAttr override Tier per function
+    bool HonorTierAttribute = true;
+
+    // Use the dynamically sized register unit occupancy kernel on every target
+    bool GenericUnitKernel = false;
+
+    RegAllocMinimalOrder Order = RegAllocMinimalOrder::BlockSpan;
+
+    /*
+    Heuristics, with the defaults of their -regalloc-minimal-* options. Block
+    frequencies are relative to the entry block.
+    */
+    // Split a block-local interval at a stretch of this many instructions without references, 0 disables
+    unsigned LocalSplitGap = 64;
+    // Pick eviction victims among block-local intervals by furthest next use
+    bool NextUseEviction = true;
+    // Keep destinations with a false dependency away from registers written shortly before
+    bool AvoidFalseDependencies = true;
+    double FalseDependencyMinFrequency = 4.0;
+    // Blocks below this frequency are off the hot path
+    double ColdBlockFrequency = 0.2;
+    // Keep hot path intervals off callee-saved registers the hot path does not use yet
+    bool HotPathCallerSaved = true;
+    // Split an interval into its hot and cold blocks before spilling it
+    bool HotColdSplit = true;
+    // Store nearby scalar FP spills with one vector store (x86-64)
+    bool SpillPacking = false;
+    unsigned SpillPackingWindow = 4;
+
+    /*
+    Repair an existing allocation instead of allocating from scratch.
+
+    A repair instance goes after the allocator, before the rewriter, and picks up the
+    VirtRegMap, LiveRegMatrix and LiveIntervals the allocator preserved. It
+    allocates only the virtual registers that have uses but no assigned register:
+    the ones created by late passes for the instructions they inserted, and the
+    ones whose interval a pass changed. A pass changing the interval of an
+    assigned register has to LiveRegMatrix::unassign it before the change, while
+    the matrix still holds the old segments.
+
+    To make room, the repair only evicts intervals that are local to one block
+    and lighter than the one it allocates, at most RepairEvictionBudget of them
+    per function. Otherwise the new interval is spilled. When an unspillable
+    interval finds no register, NeedsFullRerun is reported (see
+    RegAllocMinimalStats) and the function fails to compile: the repair emits an
+    error through the LLVMContext of the function, before the rewriter runs. The
+    interval gets the first register of its class so the rest of the pipeline
+    still sees well-formed MIR, but its output must be thrown away. A driver
+    installs a diagnostic handler, sees the error, and compiles the function
+    again with a full allocation.
+
+    If the passes in between did not preserve the allocation state, the analyses
+    are recomputed and the repair allocates the whole function.
+    */
+    bool Repair = false;
+    unsigned RepairEvictionBudget = 8;
+};
+
+// What the allocator did to one function.
+struct RegAllocMinimalStats {
+    // Virtual registers queued at the start, not counting split and spill products
+    unsigned NumVirtRegs = 0;
+    unsigned NumAssignments = 0;
+    // Assigned intervals evicted and spilled to make room for a heavier one
+    unsigned NumEvictions = 0;
+    // Intervals handed to the spiller, evicted ones included
+    unsigned NumSpills = 0;
+    // Enqueues of registers that were split or spilled from an already queued one
+    unsigned NumRequeues = 0;
+    double Seconds = 0;
+    // Repair only: an interval is left without a register, allocate the whole function again
+    bool NeedsFullRerun = false;
+};
+
+// Called by the allocator after every function it allocated.
+using RegAllocMinimalStatsHandler = std::function<void(const MachineFunction &, const RegAllocMinimalStats &)>;
+
+// Create an instance of the Minimal Register Allocator running at the given tier.
+FunctionPass *createRegisterAllocatorMinimal(RegAllocMinimalTier Tier = RegAllocMinimalTier::Full);
+
+FunctionPass *createRegisterAllocatorMinimal(const RegAllocMinimalOptions &Options,
+                                             RegAllocMinimalStatsHandler StatsHandler = nullptr);
+
+}
+
+#endif
@@ -0,0 +1,148 @@
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/CodeGen/MIRParser/MIRParser.h>
+#include <llvm/CodeGen/MIRPrinter.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/MachineModuleInfo.h>
+#include <llvm/CodeGen/Passes.h>
+#include <llvm/CodeGen/TargetPassConfig.h>
+#include <llvm/IR/DiagnosticHandler.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticPrinter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/InitializePasses.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/PassRegistry.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Triple.h>
+
+#include "RegisterAllocatorAPI.h"
+
+#include "mutex"
+#include "optional"
+
+using namespace llvm;
+
+namespace {
+
+/*
+Keeps the errors of one call instead of letting the default handler print them
+and exit the process.
+*/
+struct CollectingDiagnosticHandler : DiagnosticHandler {
+    std::string &Errors;
+
+    CollectingDiagnosticHandler(std::string &Errors) : Errors(Errors) {}
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        if(DI.getSeverity() == DS_Error) {
+            raw_string_ostream OS(Errors);
+            DiagnosticPrinterRawOStream Printer(OS);
+            DI.print(Printer);
+            OS << "\n";
+        }
+        return true;
+    }
+};
+
+void initializePasses() {
+    static std::once_flag Initialized;
+    std::call_once(Initialized, []() {
+        PassRegistry &Registry = *PassRegistry::getPassRegistry();
+        initializeCore(Registry);
+        initializeAnalysis(Registry);
+        initializeCodeGen(Registry);
+        initializeTarget(Registry);
+    });
+}
+
+Error makeError(std::string &Errors, StringRef Fallback) {
+    return createStringError(inconvertibleErrorCode(), Errors.empty() ? Fallback.str() : Errors);
+}
+
+}
+
+Expected<regalloc::MIRAllocation> regalloc::allocateMIR(StringRef MIR, const RegAllocMinimalOptions &Options,
+                                                        StringRef CPU, StringRef Features) {
+    initializePasses();
+
+    std::string Errors;
+    LLVMContext Context;
+    Context.setDiagnosticHandler(std::make_unique<CollectingDiagnosticHandler>(Errors));
+
+    std::unique_ptr<MIRParser> Parser =
+        createMIRParser(MemoryBuffer::getMemBuffer(MIR, "<mir>", /*RequiresNullTerminator=*/false), Context);
+    if(!Parser) {
+        return makeError(Errors, "could not read the MIR");
+    }
+    std::unique_ptr<Module> M = Parser->parseIRModule();
+    if(!M) {
+        return makeError(Errors, "could not parse the IR of the MIR");
+    }
+
+    std::string TargetError;
+    const Target *TheTarget = TargetRegistry::lookupTarget(M->getTargetTriple(), TargetError);
+    if(!TheTarget) {
+        return createStringError(inconvertibleErrorCode(), TargetError);
+    }
+    std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+        M->getTargetTriple(), CPU, Features, TargetOptions(), std::nullopt, std::nullopt,
+        CodeGenOptLevel::Default));
+    if(!TM) {
+        return createStringError(inconvertibleErrorCode(), "could not allocate a target machine for %s",
+                                 M->getTargetTriple().c_str());
+    }
+    M->setDataLayout(TM->createDataLayout());
+
+    LLVMTargetMachine &LTM = static_cast<LLVMTargetMachine &>(*TM);
+    auto MMIWP = std::make_unique<MachineModuleInfoWrapperPass>(&LTM);
+    if(Parser->parseMachineFunctions(*M, MMIWP->getMMI())) {
+        return makeError(Errors, "could not parse the machine functions of the MIR");
+    }
+    // The pass manager would build machine functions for them and run the allocator on IR.
+    for(Function &F: *M) {
+        if(!F.isDeclaration() && !MMIWP->getMMI().getMachineFunction(F)) {
+            F.deleteBody();
+        }
+    }
+
+    MIRAllocation Result;
+    RegAllocMinimalStatsHandler StatsHandler = [&Result](const MachineFunction &MF,
+                                                         const RegAllocMinimalStats &Stats) {
+        Result.Functions.push_back({MF.getName().str(), Stats});
+    };
+
+    // Same setup as llc -run-pass
+    raw_string_ostream OS(Result.MIR);
+    legacy::PassManager PM;
+    PM.add(new TargetLibraryInfoWrapperPass(TargetLibraryInfoImpl(Triple(M->getTargetTriple()))));
+    TargetPassConfig *PassConfig = LTM.createPassConfig(PM);
+    PM.add(PassConfig);
+    PM.add(MMIWP.release());
+    PM.add(createRegisterAllocatorMinimal(Options, std::move(StatsHandler)));
+    PM.add(createVirtRegRewriter());
+    PassConfig->setInitialized();
+    PM.add(createPrintMIRPass(OS));
+    PM.run(*M);
+
+    if(!Errors.empty()) {
+        return makeError(Errors, "");
+    }
+    OS.flush();
+    return std::move(Result);
+}
+
+Expected<regalloc::MIRAllocation> regalloc::allocateMachineFunction(const MachineFunction &MF,
+                                                                    const RegAllocMinimalOptions &Options) {
+    std::string MIR;
+    raw_string_ostream OS(MIR);
+    printMIR(OS, *MF.getFunction().getParent());
+    printMIR(OS, MF);
+    OS.flush();
+
+    const TargetMachine &TM = MF.getTarget();
+    return allocateMIR(MIR, Options, TM.getTargetCPU(), TM.getTargetFeatureString());
+}
@@ -0,0 +1,69 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_API_H
+#define REGISTER_ALLOCATOR_MINIMAL_API_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include "RegisterAllocator.h"
+
+#include "string"
+#include "vector"
+
+/*
+In-process entry points of the Minimal Register Allocator, for tools that want an
+allocated function back rather than a codegen pipeline to put the allocator in.
+
+The input is MIR as it looks right before register allocation, for example
+
+    llc -load libRegAlloc.so -regalloc=register-allocator-minimal -stop-before=regallominimal
+
+The allocator and the virtual register rewriter run on every machine function of
+it, nothing else does. IR functions without a machine function are dropped to
+declarations.
+
+The targets used have to be initialized by the caller (InitializeAllTargets and
+InitializeAllTargetMCs, or the ones of the targets it compiles for). The codegen
+passes are registered on the first call. Calls are independent of each other,
+each one gets its own LLVMContext, so they can run concurrently. The allocation
+only depends on Options, not on the command line; only the diagnostic outputs
+listed at RegAllocMinimalOptions, such as -regalloc-minimal-trace, are still
+read from it.
+
+A pipeline that is already built, like a JIT's codegen pipeline, adds the pass
+from createRegisterAllocatorMinimal(Options, StatsHandler) instead.
+*/
+namespace llvm {
+
+class MachineFunction;
+
+namespace regalloc {
+
+struct FunctionAllocation {
+    std::string Name;
+    RegAllocMinimalStats Stats;
+};
+
+struct MIRAllocation {
+    // The allocated module, printed as MIR
+    std::string MIR;
+    // One entry per machine function, in the order they were allocated
+    std::vector<FunctionAllocation> Functions;
+};
+
+/*
+Allocate every machine function of MIR. CPU and Features override the target
+of the module, the attributes of each function still apply on top of them.
+*/
+Expected<MIRAllocation> allocateMIR(StringRef MIR, const RegAllocMinimalOptions &Options, StringRef CPU = "",
+                                    StringRef Features = "");
+
+/*
+Allocate a copy of MF. MF itself is left alone: it belongs to the machine module
+of its pipeline, the copy is made by printing MF with its IR module as MIR.
+*/
+Expected<MIRAllocation> allocateMachineFunction(const MachineFunction &MF, const RegAllocMinimalOptions &Options);
+
+}
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include <llvm/Support/Error.h>
+
+#include "RegisterAllocatorAPI.h"
+#include "RegisterAllocatorC.h"
+
+#include "cstring"
+
+using namespace llvm;
+
+void LLVMRegAllocMinimalInitOptions(LLVMRegAllocMinimalOptions *Options) {
+    RegAllocMinimalOptions Defaults;
+    Options->Tier = Defaults.Tier == RegAllocMinimalTier::Fast ? LLVMRegAllocMinimalTierFast
+                                                                : LLVMRegAllocMinimalTierFull;
+    Options->HonorTierAttribute = Defaults.HonorTierAttribute;
+    Options->GenericUnitKernel = Defaults.GenericUnitKernel;
+    Options->LoopNestOrder = Defaults.Order == RegAllocMinimalOrder::LoopNest;
+    Options->LocalSplitGap = Defaults.LocalSplitGap;
+    Options->NextUseEviction = Defaults.NextUseEviction;
+    Options->AvoidFalseDependencies = Defaults.AvoidFalseDependencies;
+    Options->FalseDependencyMinFrequency = Defaults.FalseDependencyMinFrequency;
+    Options->ColdBlockFrequency = Defaults.ColdBlockFrequency;
+    Options->HotPathCallerSaved = Defaults.HotPathCallerSaved;
+    Options->HotColdSplit = Defaults.HotColdSplit;
+    Options->SpillPacking = Defaults.SpillPacking;
+    Options->SpillPackingWindow = Defaults.SpillPackingWindow;
+}
+
+LLVMBool LLVMRegAllocMinimalAllocateMIR(const char *MIR, size_t Length, const LLVMRegAllocMinimalOptions *Options,
+                                        const char *CPU, const char *Features, char **OutMIR,
+                                        LLVMRegAllocMinimalStats *OutStats, char **OutMessage) {
+    RegAllocMinimalOptions AllocatorOptions;
+    AllocatorOptions.Tier = Options->Tier == LLVMRegAllocMinimalTierFast ? RegAllocMinimalTier::Fast
+                                                                         : RegAllocMinimalTier::Full;
+    AllocatorOptions.HonorTierAttribute = Options->HonorTierAttribute;
+    AllocatorOptions.GenericUnitKernel = Options->GenericUnitKernel;
+    AllocatorOptions.Order = Options->LoopNestOrder ? RegAllocMinimalOrder::LoopNest : RegAllocMinimalOrder::BlockSpan;
+    AllocatorOptions.LocalSplitGap = Options->LocalSplitGap;
+    AllocatorOptions.NextUseEviction = Options->NextUseEviction;
+    AllocatorOptions.AvoidFalseDependencies = Options->AvoidFalseDependencies;
+    AllocatorOptions.FalseDependencyMinFrequency = Options->FalseDependencyMinFrequency;
+    AllocatorOptions.ColdBlockFrequency = Options->ColdBlockFrequency;
+    AllocatorOptions.HotPathCallerSaved = Options->HotPathCallerSaved;
+    AllocatorOptions.HotColdSplit = Options->HotColdSplit;
+    AllocatorOptions.SpillPacking = Options->SpillPacking;
+    AllocatorOptions.SpillPackingWindow = Options->SpillPackingWindow;
+
+    Expected<regalloc::MIRAllocation> Result = regalloc::allocateMIR(
+        StringRef(MIR, Length), AllocatorOptions, CPU ? CPU : "", Features ? Features : "");
+    if(!Result) {
+        *OutMessage = strdup(toString(Result.takeError()).c_str());
+        return 1;
+    }
+
+    *OutMIR = strdup(Result->MIR.c_str());
+    if(OutStats) {
+        *OutStats = LLVMRegAllocMinimalStats();
+        for(const regalloc::FunctionAllocation &Function: Result->Functions) {
+            OutStats->NumFunctions++;
+            OutStats->NumVirtRegs += Function.Stats.NumVirtRegs;
+            OutStats->NumAssignments += Function.Stats.NumAssignments;
+            OutStats->NumEvictions += Function.Stats.NumEvictions;
+            OutStats->NumSpills += Function.Stats.NumSpills;
+            OutStats->NumRequeues += Function.Stats.NumRequeues;
+            OutStats->Seconds += Function.Stats.Seconds;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_C_H
+#define REGISTER_ALLOCATOR_MINIMAL_C_H
+
+#include <llvm-c/ExternC.h>
+#include <llvm-c/Types.h>
+
+#include "stddef.h"
+
+/*
+C interface of the Minimal Register Allocator, a thin layer over
+regalloc::allocateMIR (see RegisterAllocatorAPI.h) for embedders that are not
+written in C++.
+
+Strings returned through OutMIR and OutMessage are released with
+LLVMDisposeMessage.
+*/
+LLVM_C_EXTERN_C_BEGIN
+
+typedef enum {
+    LLVMRegAllocMinimalTierFast,
+    LLVMRegAllocMinimalTierFull
+} LLVMRegAllocMinimalTier;
+
+typedef struct {
+    LLVMRegAllocMinimalTier Tier;
+    LLVMBool HonorTierAttribute;
+    LLVMBool GenericUnitKernel;
+    // Loop nest instead of block span allocation order
+    LLVMBool LoopNestOrder;
+    // Heuristics, see RegAllocMinimalOptions
+    unsigned LocalSplitGap;
+    LLVMBool NextUseEviction;
+    LLVMBool AvoidFalseDependencies;
+    double FalseDependencyMinFrequency;
+    double ColdBlockFrequency;
+    LLVMBool HotPathCallerSaved;
+    LLVMBool HotColdSplit;
+    LLVMBool SpillPacking;
+    unsigned SpillPackingWindow;
+} LLVMRegAllocMinimalOptions;
+
+// Totals over all functions of one call, see RegAllocMinimalStats
+typedef struct {
+    unsigned NumFunctions;
+    unsigned NumVirtRegs;
+    unsigned NumAssignments;
+    unsigned NumEvictions;
+    unsigned NumSpills;
+    unsigned NumRequeues;
+    double Seconds;
+} LLVMRegAllocMinimalStats;
+
+// Fill Options with the defaults of RegAllocMinimalOptions.
+void LLVMRegAllocMinimalInitOptions(LLVMRegAllocMinimalOptions *Options);
+
+/*
+Allocate every machine function of the Length bytes of MIR at MIR. CPU and
+Features may be NULL. Returns 0 on success, with the allocated MIR in *OutMIR and
+the statistics in *OutStats when it is not NULL. Returns 1 on failure, with the
+errors in *OutMessage.
+*/
+LLVMBool LLVMRegAllocMinimalAllocateMIR(const char *MIR, size_t Length, const LLVMRegAllocMinimalOptions *Options,
+                                        const char *CPU, const char *Features, char **OutMIR,
+                                        LLVMRegAllocMinimalStats *OutStats, char **OutMessage);
+
+LLVM_C_EXTERN_C_END
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_REGISTER_FILE_KERNEL_H
+#define REGISTER_ALLOCATOR_MINIMAL_REGISTER_FILE_KERNEL_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/MachineRegisterInfo.h>
+#include <llvm/CodeGen/TargetRegisterInfo.h>
+#include <llvm/CodeGen/TargetSubtargetInfo.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Triple.h>
+
+#include "bitset"
+#include "memory"
+
+/*
+Register unit occupancy of one function, used to answer the common case of the
+candidate scan without a LiveRegMatrix query.
+
+A register unit is "touched" when
+    - a physical register containing it appears in an operand or a block live-in
+      list, so it may have a fixed live range, or is reserved, or
+    - a virtual register was assigned to a physical register containing it.
+A candidate none of whose units is touched, and that is not clobbered by a
+register mask the interval crosses, is free: LiveRegMatrix::checkInterference
+would return IK_Free for it. Everything else still goes to the LiveRegMatrix.
+
+Units are never cleared again, an eviction leaves them touched. The occupancy only
+has to be a superset of the real one, and spill code and rematerialized
+instructions only use physical registers the function already referenced.
+
+The number of register units is fixed per target, so for the targets we compile
+for the mask is a std::bitset sized by a constexpr bound of that target: the mask
+lives inline in the kernel, bound checks and word loops have a compile-time trip
+count. Any other target, or a target whose TableGen output outgrew the bound,
+gets the same kernel over a BitVector sized at run time.
+*/
+namespace llvm {
+namespace regalloc {
+
+/*
+Register files of the targets with a specialized kernel. MaxRegUnits is an upper
+bound on TargetRegisterInfo::getNumRegUnits(), checked when the kernel is created.
+*/
+struct X86_64RegisterFile {
+    static constexpr unsigned MaxRegUnits = 512;
+
+    static constexpr bool matches(Triple::ArchType Arch) {
+        return Arch == Triple::x86_64;
+    }
+};
+
+struct AArch64RegisterFile {
+    static constexpr unsigned MaxRegUnits = 512;
+
+    static constexpr bool matches(Triple::ArchType Arch) {
+        return Arch == Triple::aarch64 || Arch == Triple::aarch64_be;
+    }
+};
+
+struct RISCVRegisterFile {
+    static constexpr unsigned MaxRegUnits = 256;
+
+    static constexpr bool matches(Triple::ArchType Arch) {
+        return Arch == Triple::riscv32 || Arch == Triple::riscv64;
+    }
+};
+
+// Unit mask with a compile-time size
+template <unsigned NumUnits>
+struct FixedUnitMask {
+    using Mask = std::bitset<NumUnits>;
+
+    static void init(Mask &Units, unsigned) {
+        Units.reset();
+    }
+};
+
+// Unit mask sized for the target at run time
+struct DynamicUnitMask {
+    using Mask = BitVector;
+
+    static void init(Mask &Units, unsigned NumUnits) {
+        Units.clear();
+        Units.resize(NumUnits);
+    }
+};
+
+class UnitOccupancy {
+public:
+    virtual ~UnitOccupancy() = default;
+
+    // Start a new function: mark the units of its reserved, fixed and live-in registers.
+    virtual void reset(const MachineFunction &MF) = 0;
+
+    virtual void markAssigned(MCRegister PhysReg) = 0;
+
+    /*
+    Index of the first of Candidates that is free without asking the LiveRegMatrix,
+    Candidates.size() if there is none. RegMaskUsable is the result of
+    LiveIntervals::checkRegMaskInterference for the interval, empty when it crosses
+    no register mask.
+    */
+    virtual size_t findUntouched(ArrayRef<MCPhysReg> Candidates, const BitVector &RegMaskUsable) const = 0;
+};
+
+template <typename MaskTraits>
+class UnitOccupancyKernel final : public UnitOccupancy {
+private:
+    const TargetRegisterInfo *TRI = nullptr;
+    typename MaskTraits::Mask Touched;
+
+    void markUnits(MCRegister PhysReg) {
+        for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+            Touched.set(*Unit);
+        }
+    }
+
+    bool isUntouched(MCRegister PhysReg) const {
+        for(MCRegUnitIterator Unit(PhysReg, TRI); Unit.isValid(); ++Unit) {
+            if(Touched.test(*Unit)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    void reset(const MachineFunction &MF) override {
+        TRI = MF.getSubtarget().getRegisterInfo();
+        MaskTraits::init(Touched, TRI->getNumRegUnits());
+
+        const MachineRegisterInfo &MRI = MF.getRegInfo();
+        for(unsigned Reg: MRI.getReservedRegs().set_bits()) {
+            markUnits(MCRegister(Reg));
+        }
+        for(const MachineBasicBlock &MBB: MF) {
+            for(const MachineBasicBlock::RegisterMaskPair &LiveIn: MBB.liveins()) {
+                markUnits(LiveIn.PhysReg);
+            }
+            for(const MachineInstr &MI: MBB) {
+                for(const MachineOperand &MO: MI.operands()) {
+                    if(MO.isReg() && MO.getReg().isPhysical()) {
+                        markUnits(MO.getReg().asMCReg());
+                    }
+                }
+            }
+        }
+    }
+
+    void markAssigned(MCRegister PhysReg) override {
+        markUnits(PhysReg);
+    }
+
+    size_t findUntouched(ArrayRef<MCPhysReg> Candidates, const BitVector &RegMaskUsable) const override {
+        bool CrossesRegMask = !RegMaskUsable.empty();
+        for(size_t Idx = 0; Idx < Candidates.size(); Idx++) {
+            MCPhysReg PhysReg = Candidates[Idx];
+            if(CrossesRegMask && !RegMaskUsable.test(PhysReg)) {
+                continue;
+            }
+            if(isUntouched(PhysReg)) {
+                return Idx;
+            }
+        }
+        return Candidates.size();
+    }
+};
+
+template <typename RegisterFile>
+std::unique_ptr<UnitOccupancy> createFixedUnitOccupancy(Triple::ArchType Arch, unsigned NumUnits) {
+    if(!RegisterFile::matches(Arch) || NumUnits > RegisterFile::MaxRegUnits) {
+        return nullptr;
+    }
+    return std::make_unique<UnitOccupancyKernel<FixedUnitMask<RegisterFile::MaxRegUnits>>>();
+}
+
+/*
+Pick the occupancy kernel for the target of MF. Generic selects the dynamically
+sized kernel on every target.
+*/
+inline std::unique_ptr<UnitOccupancy> createUnitOccupancy(const MachineFunction &MF, bool Generic) {
+    Triple::ArchType Arch = MF.getTarget().getTargetTriple().getArch();
+    unsigned NumUnits = MF.getSubtarget().getRegisterInfo()->getNumRegUnits();
+
+    std::unique_ptr<UnitOccupancy> Kernel;
+    if(!Generic) {
+        Kernel = createFixedUnitOccupancy<X86_64RegisterFile>(Arch, NumUnits);
+        if(!Kernel) {
+            Kernel = createFixedUnitOccupancy<AArch64RegisterFile>(Arch, NumUnits);
+        }
+        if(!Kernel) {
+            Kernel = createFixedUnitOccupancy<RISCVRegisterFile>(Arch, NumUnits);
+        }
+    }
+    if(!Kernel) {
+        Kernel = std::make_unique<UnitOccupancyKernel<DynamicUnitMask>>();
+    }
+    return Kernel;
+}
+
+}
+}
+
+#endif
@@ -1,15 +1,36 @@
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/Analysis.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/OptimizationLevel.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <queue>
+
 using namespace llvm;
 
+#define DEBUG_TYPE "pressure-sink"
+
+STATISTIC(NumSunk, "Number of instructions sunk toward their single use");
+STATISTIC(NumRematerialized, "Number of cheap instructions rematerialized at their uses");
+
+static cl::opt<unsigned> CodeGenPartitions(
+    "codegen-partitions",
+    cl::desc("Number of cost balanced partitions to assign functions to for parallel code generation "
+             "(0 disables the partitioning pass)"),
+    cl::init(0));
+
 namespace {
 
 struct DummyPass: PassInfoMixin<DummyPass> {
@@ -22,6 +43,395 @@ struct DummyPass: PassInfoMixin<DummyPass> {
     };
 };
 
+/*
+Values that occupy a register once the IR is lowered: instruction results and
+arguments of first class type. Static allocas become frame indexes and are left out.
+*/
+static bool needsRegister(const Value *V) {
+    if(!isa<Instruction>(V) && !isa<Argument>(V)) {
+        return false;
+    }
+    if(const AllocaInst *AI = dyn_cast<AllocaInst>(V)) {
+        if(AI->isStaticAlloca()) {
+            return false;
+        }
+    }
+
+    Type *Ty = V->getType();
+    return !Ty->isVoidTy() && !Ty->isTokenTy() && !Ty->isMetadataTy() && !Ty->isLabelTy();
+}
+
+/*
+IR-level register pressure of a basic block: the highest number of values live at
+the same time, bucketed by the target register class they will be allocated from.
+
+Liveness is local to the block. A value is live from its definition (or the block
+entry) to its last use in the block, and to the block exit if it is used in
+another block. Values that only pass through the block are not counted, so this
+underestimates the pressure the allocator will see.
+*/
+struct BlockPressure {
+    SmallDenseMap<unsigned, unsigned, 4> MaxLive;
+
+    // Sum of the values live above the register count of their class, at the block's peak.
+    unsigned getExcess(const TargetTransformInfo &TTI) const {
+        unsigned Excess = 0;
+        for(const auto &[ClassID, Live]: MaxLive) {
+            unsigned NumRegs = TTI.getNumberOfRegisters(ClassID);
+            if(Live > NumRegs) {
+                Excess += Live - NumRegs;
+            }
+        }
+        return Excess;
+    }
+};
+
+static unsigned getRegisterClass(const Value *V, const TargetTransformInfo &TTI) {
+    Type *Ty = V->getType();
+    return TTI.getRegisterClassForType(Ty->isVectorTy() || Ty->isFloatingPointTy(), Ty);
+}
+
+static BlockPressure estimateBlockPressure(const BasicBlock &BB, const TargetTransformInfo &TTI) {
+    BlockPressure Pressure;
+    SmallPtrSet<const Value *, 32> Live;
+    SmallDenseMap<unsigned, unsigned, 4> LiveCount;
+
+    auto addLive = [&](const Value *V) {
+        if(needsRegister(V) && Live.insert(V).second) {
+            unsigned &Count = LiveCount[getRegisterClass(V, TTI)];
+            Count++;
+        }
+    };
+    auto removeLive = [&](const Value *V) {
+        if(Live.erase(V)) {
+            LiveCount[getRegisterClass(V, TTI)]--;
+        }
+    };
+    auto recordPeak = [&]() {
+        for(const auto &[ClassID, Count]: LiveCount) {
+            unsigned &Max = Pressure.MaxLive[ClassID];
+            Max = std::max(Max, Count);
+        }
+    };
+
+    // Values defined here and used by other blocks are live at the block exit.
+    for(const Instruction &I: BB) {
+        for(const User *U: I.users()) {
+            if(cast<Instruction>(U)->getParent() != &BB || isa<PHINode>(U)) {
+                addLive(&I);
+                break;
+            }
+        }
+    }
+    recordPeak();
+
+    // Walk backwards: a definition ends the live range, a use starts it.
+    for(const Instruction &I: reverse(BB)) {
+        removeLive(&I);
+        if(!isa<PHINode>(I)) {
+            for(const Value *Op: I.operands()) {
+                addLive(Op);
+            }
+        }
+        recordPeak();
+    }
+
+    return Pressure;
+}
+
+/*
+Pressure reducing sinking, run at the end of the optimization pipeline.
+
+For every block whose pressure estimate exceeds the target's register count:
+
+1. Sinking: an instruction without side effects and with a single use is moved
+   right in front of that use, possibly into another block. This ends its live
+   range where it is consumed. Only instructions reading at most one register
+   value are moved, so sinking never extends more live ranges than it shortens.
+   Instructions are never sunk into a loop they are not already in.
+
+2. Rematerialization: a cheap instruction with uses in other blocks is cloned in
+   front of each such use, when the operands are constants or are used in that
+   block anyway. The original value then no longer has to be kept alive across
+   the high pressure region between the definition and its uses.
+
+The instruction selector and the register allocator then see shorter live ranges
+where they need them, and spill less.
+*/
+struct PressureSinkPass: PassInfoMixin<PressureSinkPass> {
+    static bool isMovable(const Instruction &I) {
+        return !isa<PHINode>(I) && !I.isTerminator() && !I.isEHPad() && !isa<AllocaInst>(I)
+            && !I.mayHaveSideEffects() && !I.mayReadFromMemory();
+    }
+
+    static unsigned countRegisterOperands(const Instruction &I) {
+        unsigned NumRegOps = 0;
+        for(const Value *Op: I.operands()) {
+            if(needsRegister(Op)) {
+                NumRegOps++;
+            }
+        }
+        return NumRegOps;
+    }
+
+    // Move I in front of its only user, returns true if I was moved.
+    static bool sinkToUse(Instruction &I, const DominatorTree &DT, const LoopInfo &LI) {
+        if(!isMovable(I) || !I.hasOneUse() || countRegisterOperands(I) > 1) {
+            return false;
+        }
+
+        Instruction *User = cast<Instruction>(*I.user_begin());
+        Instruction *InsertPt = User;
+        if(PHINode *PN = dyn_cast<PHINode>(User)) {
+            // The value is consumed at the end of the incoming block.
+            InsertPt = PN->getIncomingBlock(*I.use_begin())->getTerminator();
+        }
+
+        BasicBlock *From = I.getParent();
+        BasicBlock *To = InsertPt->getParent();
+        if(To == From) {
+            // Already adjacent to its use
+            if(I.getNextNode() == InsertPt) {
+                return false;
+            }
+        } else {
+            if(!DT.dominates(From, To) || To->isEHPad()) {
+                return false;
+            }
+            // Never sink into a loop, that would execute I more often.
+            const Loop *ToLoop = LI.getLoopFor(To);
+            if(ToLoop && !ToLoop->contains(From)) {
+                return false;
+            }
+        }
+
+        I.moveBefore(InsertPt);
+        return true;
+    }
+
+    /*
+    Clone I in front of its users outside of I's block. Returns true if I was
+    rematerialized for at least one user.
+    */
+    static bool rematerializeAtUses(Instruction &I, const TargetTransformInfo &TTI,
+                                    const DenseMap<const BasicBlock *, unsigned> &Excess) {
+        if(!isMovable(I) || I.hasOneUse() || I.use_empty()) {
+            return false;
+        }
+        if(TTI.getInstructionCost(&I, TargetTransformInfo::TCK_SizeAndLatency) > TargetTransformInfo::TCC_Basic) {
+            return false;
+        }
+
+        // Register operands must already be used in the block of the clone.
+        auto isLiveIn = [&](const BasicBlock *BB) {
+            for(const Value *Op: I.operands()) {
+                if(!needsRegister(Op)) {
+                    continue;
+                }
+                bool UsedInBB = any_of(Op->users(), [&](const User *U) {
+                    return U != &I && cast<Instruction>(U)->getParent() == BB;
+                });
+                if(!UsedInBB) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        bool Changed = false;
+        for(Use &U: make_early_inc_range(I.uses())) {
+            Instruction *User = cast<Instruction>(U.getUser());
+            BasicBlock *UseBB = User->getParent();
+            if(UseBB == I.getParent() || isa<PHINode>(User) || UseBB->isEHPad()) {
+                continue;
+            }
+            if(!Excess.lookup(UseBB) && !Excess.lookup(I.getParent())) {
+                continue;
+            }
+            if(!isLiveIn(UseBB)) {
+                continue;
+            }
+
+            Instruction *Clone = I.clone();
+            Clone->setName(I.getName() + ".remat");
+            Clone->insertBefore(User);
+            U.set(Clone);
+            Changed = true;
+            NumRematerialized++;
+        }
+
+        if(I.use_empty()) {
+            I.eraseFromParent();
+        }
+        return Changed;
+    }
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        const TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        const DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+        const LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+
+        DenseMap<const BasicBlock *, unsigned> Excess;
+        for(const BasicBlock &BB: F) {
+            if(unsigned BlockExcess = estimateBlockPressure(BB, TTI).getExcess(TTI)) {
+                Excess[&BB] = BlockExcess;
+            }
+        }
+        if(Excess.empty()) {
+            return PreservedAnalyses::all();
+        }
+
+        bool Changed = false;
+        for(BasicBlock &BB: F) {
+            if(!Excess.count(&BB)) {
+                continue;
+            }
+
+            // Bottom up, so that chains of single use instructions sink together.
+            for(Instruction &I: make_early_inc_range(reverse(BB))) {
+                if(sinkToUse(I, DT, LI)) {
+                    Changed = true;
+                    NumSunk++;
+                    continue;
+                }
+                Changed |= rematerializeAtUses(I, TTI, Excess);
+            }
+        }
+
+        if(!Changed) {
+            return PreservedAnalyses::all();
+        }
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+
+/*
+Cost balanced partitioning of a module for parallel code generation.
+
+Splitting a module by name hash or round robin ignores how expensive each function
+is to compile, and with a few very large generated functions one backend ends up
+with most of the work. This pass estimates the codegen cost of every function and
+balances the partitions on that estimate.
+
+Cost of a function, summed over its blocks:
+
+    Instructions * (1 + LoopDepth) + Instructions * PressureExcess
+
+Loop depth stands in for the extra scheduling and splitting work in loops, the
+pressure excess (see BlockPressure) for the eviction and spilling work in the
+register allocator.
+
+Functions of the same comdat stay together. Groups are assigned heaviest first to
+the currently lightest partition (longest processing time first).
+
+The result is attached as metadata, for the driver or a SplitModule callback to
+honour:
+    - every function:    !codegen.partition !{i32 <partition>, i64 <cost>}
+    - the module:        !codegen.partitions = !{!{i32 <partition>, i64 <total cost>}, ...}
+*/
+struct CodeGenPartitionPass: PassInfoMixin<CodeGenPartitionPass> {
+    unsigned NumPartitions;
+
+    CodeGenPartitionPass(unsigned NumPartitions) : NumPartitions(NumPartitions) {}
+
+    static uint64_t estimateCodeGenCost(Function &F, FunctionAnalysisManager &FAM) {
+        const TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        const LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+
+        uint64_t Cost = 0;
+        for(const BasicBlock &BB: F) {
+            uint64_t NumInsts = BB.size();
+            Cost += NumInsts * (1 + LI.getLoopDepth(&BB));
+            Cost += NumInsts * estimateBlockPressure(BB, TTI).getExcess(TTI);
+        }
+        return Cost;
+    }
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        if(NumPartitions < 2) {
+            return PreservedAnalyses::all();
+        }
+
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        LLVMContext &Ctx = M.getContext();
+        Type *Int32Ty = Type::getInt32Ty(Ctx);
+        Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+        // Group the functions that have to be emitted together, in module order.
+        struct Group {
+            SmallVector<Function *, 1> Functions;
+            uint64_t Cost = 0;
+        };
+        SmallVector<Group, 0> Groups;
+        DenseMap<const Comdat *, unsigned> ComdatGroup;
+        DenseMap<const Function *, uint64_t> FunctionCost;
+        for(Function &F: M) {
+            if(F.isDeclaration()) {
+                continue;
+            }
+
+            unsigned GroupIdx = Groups.size();
+            if(const Comdat *C = F.getComdat()) {
+                auto [It, Inserted] = ComdatGroup.try_emplace(C, GroupIdx);
+                GroupIdx = It->second;
+            }
+            if(GroupIdx == Groups.size()) {
+                Groups.emplace_back();
+            }
+
+            uint64_t Cost = estimateCodeGenCost(F, FAM);
+            FunctionCost[&F] = Cost;
+            Groups[GroupIdx].Functions.push_back(&F);
+            Groups[GroupIdx].Cost += Cost;
+        }
+
+        // Heaviest group first, module order breaks ties to keep the result deterministic.
+        SmallVector<unsigned, 0> Order(Groups.size());
+        for(unsigned GroupIdx = 0; GroupIdx < Groups.size(); GroupIdx++) {
+            Order[GroupIdx] = GroupIdx;
+        }
+        llvm::stable_sort(Order, [&](unsigned A, unsigned B) {
+            return Groups[A].Cost > Groups[B].Cost;
+        });
+
+        // Min-heap of (total cost, partition)
+        using PartitionLoad = std::pair<uint64_t, unsigned>;
+        std::priority_queue<PartitionLoad, std::vector<PartitionLoad>, std::greater<PartitionLoad>> Loads;
+        for(unsigned Partition = 0; Partition < NumPartitions; Partition++) {
+            Loads.push(std::make_pair(0, Partition));
+        }
+
+        SmallVector<uint64_t, 8> Totals(NumPartitions, 0);
+        for(unsigned GroupIdx: Order) {
+            auto [Load, Partition] = Loads.top();
+            Loads.pop();
+
+            for(Function *F: Groups[GroupIdx].Functions) {
+                F->setMetadata("codegen.partition", MDNode::get(Ctx, {
+                    ConstantAsMetadata::get(ConstantInt::get(Int32Ty, Partition)),
+                    ConstantAsMetadata::get(ConstantInt::get(Int64Ty, FunctionCost[F]))
+                }));
+            }
+
+            Totals[Partition] = Load + Groups[GroupIdx].Cost;
+            Loads.push(std::make_pair(Totals[Partition], Partition));
+        }
+
+        NamedMDNode *Summary = M.getOrInsertNamedMetadata("codegen.partitions");
+        Summary->clearOperands();
+        for(unsigned Partition = 0; Partition < NumPartitions; Partition++) {
+            Summary->addOperand(MDNode::get(Ctx, {
+                ConstantAsMetadata::get(ConstantInt::get(Int32Ty, Partition)),
+                ConstantAsMetadata::get(ConstantInt::get(Int64Ty, Totals[Partition]))
+            }));
+        }
+
+        return PreservedAnalyses::all();
+    }
+};
+
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
     return {
@@ -33,6 +443,33 @@ llvmGetPassPluginInfo() {
                 [](ModulePassManager &MPM, OptimizationLevel level) {
                     MPM.addPass(DummyPass());
                 });
+            // Late in the pipeline, after the optimizations that create pressure.
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel level) {
+                    if(level == OptimizationLevel::O0) {
+                        return;
+                    }
+                    MPM.addPass(createModuleToFunctionPassAdaptor(PressureSinkPass()));
+                    if(CodeGenPartitions > 1) {
+                        MPM.addPass(CodeGenPartitionPass(CodeGenPartitions));
+                    }
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+                    if(Name == "pressure-sink") {
+                        FPM.addPass(PressureSinkPass());
+                        return true;
+                    }
+                    return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+                    if(Name == "codegen-partition") {
+                        MPM.addPass(CodeGenPartitionPass(std::max(CodeGenPartitions.getValue(), 2u)));
+                        return true;
+                    }
+                    return false;
+                });
             }
         };
     }
@@ -0,0 +1,332 @@
+#include <llvm/ADT/StringMap.h>
+#include <llvm/CodeGen/MachineBlockFrequencyInfo.h>
+#include <llvm/CodeGen/MachineFrameInfo.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/PseudoSourceValue.h>
+#include <llvm/CodeGen/TargetInstrInfo.h>
+#include <llvm/CodeGen/TargetSubtargetInfo.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "CodeGenSupport.h"
+
+#include "algorithm"
+#include "cmath"
+#include "optional"
+#include "vector"
+
+using namespace llvm;
+
+/*
+regalloc-diff: where the Minimal Register Allocator and a reference allocator
+allocated the same module differently.
+
+The module is compiled with both allocators. On the final machine code of every
+function, right before the asm printer, each block is censused:
+    - spills and reloads: stores and loads on spill slots, prologue and
+      epilogue code excluded
+    - copies: register to register moves between different registers
+and the function records the callee-saved registers it saves.
+
+Every function gets a cost per allocator, its census weighted by block frequency
+and the per-operation costs below, and the functions are ranked by how much more
+ours costs than the reference. Under each function, the blocks that differ most.
+
+    regalloc-diff --reference=greedy --top=10 benchmark.bc
+
+Functions are matched by name, blocks by function, IR block and occurrence.
+*/
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<input bitcode or IR>"));
+
+static cl::opt<std::string> CPU("mcpu", cl::desc("Target CPU"), cl::init(""));
+
+static cl::opt<std::string> Features("mattr", cl::desc("Target features"), cl::init(""));
+
+// Not -regalloc: the codegen library registers that one already.
+static cl::opt<std::string> Allocator("allocator", cl::desc("Allocator under test"),
+                                      cl::init("register-allocator-minimal"));
+
+static cl::opt<std::string> Reference("reference", cl::desc("Reference allocator"), cl::init("greedy"));
+
+static cl::opt<unsigned> Top("top", cl::desc("Number of functions to print"), cl::init(20));
+
+static cl::opt<unsigned> BlocksPerFunction("blocks-per-function",
+                                           cl::desc("Differing blocks printed under each function"), cl::init(5));
+
+static cl::opt<double> SpillCost("spill-cost", cl::desc("Cost of a spill store"), cl::init(1.0));
+
+static cl::opt<double> ReloadCost("reload-cost", cl::desc("Cost of a reload"), cl::init(1.0));
+
+static cl::opt<double> CopyCost("copy-cost", cl::desc("Cost of a register copy"), cl::init(0.25));
+
+static cl::opt<double> CalleeSavedCost("callee-saved-cost",
+                                       cl::desc("Cost of saving and restoring one callee-saved register per call"),
+                                       cl::init(2.0));
+
+namespace {
+
+struct Census {
+    unsigned Spills = 0;
+    unsigned Reloads = 0;
+    unsigned Copies = 0;
+
+    double getCost() const {
+        return SpillCost * Spills + ReloadCost * Reloads + CopyCost * Copies;
+    }
+
+    bool operator==(const Census &Other) const {
+        return Spills == Other.Spills && Reloads == Other.Reloads && Copies == Other.Copies;
+    }
+};
+
+struct BlockCensus {
+    std::string Label;
+    double Frequency;
+    Census Counts;
+};
+
+struct FunctionCensus {
+    unsigned CalleeSaved = 0;
+    // Frequency of the entry block, scaled by profile data like the blocks
+    double EntryFrequency = 1;
+    // Blocks by key, in layout order
+    std::vector<std::pair<std::string, BlockCensus>> Blocks;
+
+    double getCost() const {
+        double Cost = CalleeSavedCost * CalleeSaved * EntryFrequency;
+        for(const auto &[Key, Block]: Blocks) {
+            Cost += Block.Frequency * Block.Counts.getCost();
+        }
+        return Cost;
+    }
+
+    Census getTotals() const {
+        Census Totals;
+        for(const auto &[Key, Block]: Blocks) {
+            Totals.Spills += Block.Counts.Spills;
+            Totals.Reloads += Block.Counts.Reloads;
+            Totals.Copies += Block.Counts.Copies;
+        }
+        return Totals;
+    }
+};
+
+// Censuses of one compile, by function name
+using ModuleCensus = StringMap<FunctionCensus>;
+
+class AllocationCensus: public MachineFunctionPass {
+private:
+    ModuleCensus &Result;
+
+    static bool accessesSpillSlot(const MachineFrameInfo &MFI, ArrayRef<const MachineMemOperand *> Accesses) {
+        return llvm::any_of(Accesses, [&](const MachineMemOperand *MMO) {
+            const auto *Slot = dyn_cast_or_null<FixedStackPseudoSourceValue>(MMO->getPseudoValue());
+            return Slot && MFI.isSpillSlotObjectIndex(Slot->getFrameIndex());
+        });
+    }
+
+public:
+    static char ID;
+
+    AllocationCensus(ModuleCensus &Result) : MachineFunctionPass(ID), Result(Result) {}
+
+    StringRef getPassName() const override {
+        return "Register allocation census";
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.setPreservesAll();
+        AU.addRequired<MachineBlockFrequencyInfoWrapperPass>();
+        MachineFunctionPass::getAnalysisUsage(AU);
+    }
+
+    bool runOnMachineFunction(MachineFunction &MF) override {
+        const MachineBlockFrequencyInfo &MBFI = getAnalysis<MachineBlockFrequencyInfoWrapperPass>().getMBFI();
+        const MachineFrameInfo &MFI = MF.getFrameInfo();
+        const TargetInstrInfo *TII = MF.getSubtarget().getInstrInfo();
+        regalloc::BlockKeys Keys(MF);
+
+        FunctionCensus &FunctionResult = Result[MF.getName()];
+        FunctionResult.CalleeSaved = MFI.isCalleeSavedInfoValid() ? MFI.getCalleeSavedInfo().size() : 0;
+        FunctionResult.EntryFrequency = regalloc::getScaledFrequency(MBFI, MF.front());
+
+        SmallVector<const MachineMemOperand *, 2> Accesses;
+        for(const MachineBasicBlock &MBB: MF) {
+            BlockCensus Block;
+            Block.Label = regalloc::BlockKeys::getLabel(MBB);
+            Block.Frequency = regalloc::getScaledFrequency(MBFI, MBB);
+
+            for(const MachineInstr &MI: MBB) {
+                // Callee-saved register saves and restores are counted per register instead.
+                if(MI.getFlag(MachineInstr::FrameSetup) || MI.getFlag(MachineInstr::FrameDestroy)) {
+                    continue;
+                }
+
+                Accesses.clear();
+                if(TII->hasStoreToStackSlot(MI, Accesses) && accessesSpillSlot(MFI, Accesses)) {
+                    Block.Counts.Spills++;
+                }
+                Accesses.clear();
+                if(TII->hasLoadFromStackSlot(MI, Accesses) && accessesSpillSlot(MFI, Accesses)) {
+                    Block.Counts.Reloads++;
+                }
+                if(std::optional<DestSourcePair> Copy = TII->isCopyInstr(MI)) {
+                    if(Copy->Destination->getReg() != Copy->Source->getReg()) {
+                        Block.Counts.Copies++;
+                    }
+                }
+            }
+            FunctionResult.Blocks.push_back({Keys.getKey(MBB), std::move(Block)});
+        }
+        return false;
+    }
+};
+
+char AllocationCensus::ID = 0;
+
+Expected<ModuleCensus> takeCensus(const Module &M, TargetMachine &TM, StringRef RegAlloc) {
+    // Code generation rewrites the IR, every allocator starts from a fresh copy.
+    std::unique_ptr<Module> Clone = CloneModule(M);
+    ModuleCensus Result;
+    raw_null_ostream Null;
+    if(Error E = regalloc::runCodeGen(*Clone, TM, RegAlloc, {new AllocationCensus(Result)}, Null,
+                                      CodeGenFileType::Null)) {
+        return std::move(E);
+    }
+    return std::move(Result);
+}
+
+std::string formatPair(unsigned Ours, unsigned Theirs) {
+    return std::to_string(Ours) + "/" + std::to_string(Theirs);
+}
+
+// One function present in both compiles
+struct FunctionDiff {
+    StringRef Name;
+    const FunctionCensus *Ours;
+    const FunctionCensus *Theirs;
+    double Delta;
+};
+
+void printBlockDiffs(const FunctionCensus &Ours, const FunctionCensus &Theirs) {
+    StringMap<const BlockCensus *> TheirBlocks;
+    for(const auto &[Key, Block]: Theirs.Blocks) {
+        TheirBlocks[Key] = &Block;
+    }
+
+    struct BlockDiff {
+        const BlockCensus *Ours;
+        const BlockCensus *Theirs;
+        double Delta;
+    };
+    std::vector<BlockDiff> Diffs;
+    for(const auto &[Key, Block]: Ours.Blocks) {
+        auto It = TheirBlocks.find(Key);
+        if(It == TheirBlocks.end() || It->second->Counts == Block.Counts) {
+            continue;
+        }
+        Diffs.push_back({&Block, It->second,
+                         Block.Frequency * Block.Counts.getCost() - It->second->Frequency * It->second->Counts.getCost()});
+    }
+
+    std::stable_sort(Diffs.begin(), Diffs.end(), [](const BlockDiff &A, const BlockDiff &B) {
+        return std::fabs(A.Delta) > std::fabs(B.Delta);
+    });
+    for(const BlockDiff &Diff: ArrayRef<BlockDiff>(Diffs).take_front(BlocksPerFunction)) {
+        outs() << format("    %+-12.4g freq %-10.4g spills %-9s reloads %-9s copies %-9s %s\n", Diff.Delta,
+                         Diff.Ours->Frequency,
+                         formatPair(Diff.Ours->Counts.Spills, Diff.Theirs->Counts.Spills).c_str(),
+                         formatPair(Diff.Ours->Counts.Reloads, Diff.Theirs->Counts.Reloads).c_str(),
+                         formatPair(Diff.Ours->Counts.Copies, Diff.Theirs->Counts.Copies).c_str(),
+                         Diff.Ours->Label.c_str());
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    regalloc::initializeLLVM();
+    cl::ParseCommandLineOptions(argc, argv, "Compare allocation decisions against a reference allocator\n");
+
+    LLVMContext Context;
+    Expected<std::unique_ptr<Module>> M = regalloc::loadModule(InputFile, Context);
+    if(!M) {
+        WithColor::error() << InputFile << ": " << toString(M.takeError()) << "\n";
+        return 1;
+    }
+    Expected<std::unique_ptr<TargetMachine>> TM = regalloc::createTargetMachine(**M, CPU, Features);
+    if(!TM) {
+        WithColor::error() << toString(TM.takeError()) << "\n";
+        return 1;
+    }
+
+    Expected<ModuleCensus> Ours = takeCensus(**M, **TM, Allocator);
+    if(!Ours) {
+        WithColor::error() << Allocator << ": " << toString(Ours.takeError()) << "\n";
+        return 1;
+    }
+    Expected<ModuleCensus> Theirs = takeCensus(**M, **TM, Reference);
+    if(!Theirs) {
+        WithColor::error() << Reference << ": " << toString(Theirs.takeError()) << "\n";
+        return 1;
+    }
+
+    // Module order, so that equal deltas print in a stable order
+    std::vector<FunctionDiff> Diffs;
+    double OurTotal = 0, TheirTotal = 0;
+    for(const Function &F: **M) {
+        auto OurIt = Ours->find(F.getName());
+        auto TheirIt = Theirs->find(F.getName());
+        if(OurIt == Ours->end() || TheirIt == Theirs->end()) {
+            continue;
+        }
+        double OurCost = OurIt->second.getCost();
+        double TheirCost = TheirIt->second.getCost();
+        OurTotal += OurCost;
+        TheirTotal += TheirCost;
+        Diffs.push_back({F.getName(), &OurIt->second, &TheirIt->second, OurCost - TheirCost});
+    }
+
+    // Regressions first, then improvements
+    std::stable_sort(Diffs.begin(), Diffs.end(), [](const FunctionDiff &A, const FunctionDiff &B) {
+        return A.Delta > B.Delta;
+    });
+
+    outs() << "Frequency weighted cost, " << Allocator << " vs " << Reference << ": "
+           << format("%.4g vs %.4g", OurTotal, TheirTotal) << "\n";
+    outs() << "Counts are " << Allocator << "/" << Reference << "\n\n";
+    outs() << "delta        cost         spills    reloads   copies    csr    function\n";
+    unsigned Printed = 0;
+    for(const FunctionDiff &Diff: Diffs) {
+        if(Printed == Top) {
+            break;
+        }
+        Census OurCounts = Diff.Ours->getTotals();
+        Census TheirCounts = Diff.Theirs->getTotals();
+        if(OurCounts == TheirCounts && Diff.Ours->CalleeSaved == Diff.Theirs->CalleeSaved) {
+            continue;
+        }
+        Printed++;
+
+        outs() << format("%+-12.4g %-12.4g %-9s %-9s %-9s %-6s %s\n", Diff.Delta, Diff.Ours->getCost(),
+                         formatPair(OurCounts.Spills, TheirCounts.Spills).c_str(),
+                         formatPair(OurCounts.Reloads, TheirCounts.Reloads).c_str(),
+                         formatPair(OurCounts.Copies, TheirCounts.Copies).c_str(),
+                         formatPair(Diff.Ours->CalleeSaved, Diff.Theirs->CalleeSaved).c_str(),
+                         Diff.Name.str().c_str());
+        printBlockDiffs(*Diff.Ours, *Diff.Theirs);
+    }
+    if(Printed == 0) {
+        outs() << "(no differences)\n";
+    }
+    return 0;
+}
@@ -0,0 +1,514 @@
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalAlias.h>
+#include <llvm/IR/GlobalIFunc.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include "CodeGenSupport.h"
+
+#include "condition_variable"
+#include "deque"
+#include "map"
+#include "mutex"
+#include "optional"
+#include "thread"
+#include "vector"
+
+using namespace llvm;
+
+/*
+regalloc-driver: llc-like driver compiling a module with the Minimal Register
+Allocator, with the codegen of the module split into partitions that run as a
+pipeline:
+
+    split ──queue──► codegen worker ×J ──reorder buffer──► writer
+      │                 │                                    │
+      │                 │ own LLVMContext and TargetMachine  │ partition order
+      │                 │ isel, allocation, emission         │
+      └ one partition at a time into bitcode                 └ one file per partition
+
+Splitting partition N+1 overlaps codegen of partition N, which overlaps writing
+partition N-1. Both stage boundaries are bounded: the splitter blocks when the
+queue is full and a worker blocks when its result is too far ahead of the next
+partition to write, so memory stays bounded whatever the order workers finish in.
+
+LLVM runs all machine passes of a function back to back in one pass manager, on
+MachineFunctions that share the module's MCContext, so the stages inside the
+codegen of one partition cannot be handed to different threads. The pipeline
+works on partitions instead, and by default every function is its own partition,
+so a module with a few huge functions still keeps one core per function busy.
+
+Partitions:
+    - functions carrying !codegen.partition metadata (pressure-sink plugin,
+      -codegen-partitions=N) are grouped by it
+    - otherwise one partition per function, functions of a comdat together
+    - global variables go with the functions of their comdat, or to the first
+      partition; aliases and ifuncs go with what they point to
+
+Local symbols are made hidden external so partitions can refer to each other.
+The output is one file per partition, <output>.<index>, or <output> alone when
+there is one partition, and the files are written in partition order.
+
+Bitcode input is loaded lazily: function bodies are only read when the partition
+holding them is extracted, and deleted again right after. The driver then holds
+the module without bodies plus the partitions in flight (one being extracted,
+the queue, one per worker), so peak memory follows the largest partitions and
+not the module. Per-function partitions make that the largest functions. When
+the partitions come from metadata, the bodies are read twice: a first scan
+collects the !codegen.partition of every function, one body at a time.
+
+    regalloc-driver -j 8 -filetype=obj module.bc -o module.o
+*/
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<input bitcode or IR>"));
+
+static cl::opt<std::string> OutputFile("o", cl::Required, cl::desc("Output file, or prefix with several partitions"),
+                                       cl::value_desc("filename"));
+
+static cl::opt<CodeGenFileType> FileType(
+    "filetype", cl::desc("Type of the output files"), cl::init(CodeGenFileType::ObjectFile),
+    cl::values(clEnumValN(CodeGenFileType::AssemblyFile, "asm", "Assembly"),
+               clEnumValN(CodeGenFileType::ObjectFile, "obj", "Object file")));
+
+enum class SplitMode { Auto, Function, None };
+
+static cl::opt<SplitMode> Split(
+    "split", cl::desc("How the module is partitioned"), cl::init(SplitMode::Auto),
+    cl::values(clEnumValN(SplitMode::Auto, "auto", "!codegen.partition metadata if present, else one per function"),
+               clEnumValN(SplitMode::Function, "function", "One partition per function"),
+               clEnumValN(SplitMode::None, "none", "The whole module in one partition")));
+
+// Not -regalloc: the codegen library registers that one already.
+static cl::opt<std::string> Allocator("allocator", cl::desc("Register allocator"),
+                                      cl::init("register-allocator-minimal"));
+
+static cl::opt<std::string> CPU("mcpu", cl::desc("Target CPU"), cl::init(""));
+
+static cl::opt<std::string> Features("mattr", cl::desc("Target features"), cl::init(""));
+
+static cl::opt<unsigned> Threads("j", cl::desc("Codegen worker threads, 0 for one per core"), cl::init(0));
+
+static cl::opt<bool> LazyLoad("lazy", cl::desc("Materialize the functions of bitcode input one partition at a time"),
+                              cl::init(true));
+
+static cl::opt<unsigned> QueueDepth("queue-depth",
+                                    cl::desc("Partitions buffered between stages, 0 for twice the threads"),
+                                    cl::init(0));
+
+namespace {
+
+// Queue between two stages, push blocks while it is full.
+template <typename T>
+class BoundedQueue {
+private:
+    std::mutex Lock;
+    std::condition_variable NotEmpty;
+    std::condition_variable NotFull;
+    std::deque<T> Items;
+    size_t Capacity;
+    bool Closed = false;
+
+public:
+    explicit BoundedQueue(size_t Capacity) : Capacity(Capacity) {}
+
+    void push(T Item) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        NotFull.wait(Guard, [&]() { return Items.size() < Capacity; });
+        Items.push_back(std::move(Item));
+        NotEmpty.notify_one();
+    }
+
+    // Next item, none once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> Guard(Lock);
+        NotEmpty.wait(Guard, [&]() { return !Items.empty() || Closed; });
+        if(Items.empty()) {
+            return std::nullopt;
+        }
+        T Item = std::move(Items.front());
+        Items.pop_front();
+        NotFull.notify_one();
+        return Item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Closed = true;
+        NotEmpty.notify_all();
+    }
+};
+
+/*
+Hands results to the writer in index order. A result more than Window ahead of
+the next one to write waits, the worker holding the next one never does.
+*/
+template <typename T>
+class ReorderBuffer {
+private:
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::map<unsigned, T> Ready;
+    unsigned Next = 0;
+    unsigned Window;
+
+public:
+    explicit ReorderBuffer(unsigned Window) : Window(Window) {}
+
+    void put(unsigned Index, T Item) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Changed.wait(Guard, [&]() { return Index < Next + Window; });
+        Ready.emplace(Index, std::move(Item));
+        Changed.notify_all();
+    }
+
+    T take() {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Changed.wait(Guard, [&]() { return Ready.count(Next) != 0; });
+        auto It = Ready.find(Next);
+        T Item = std::move(It->second);
+        Ready.erase(It);
+        Next++;
+        Changed.notify_all();
+        return Item;
+    }
+};
+
+struct PartitionInput {
+    unsigned Index;
+    SmallVector<char, 0> Bitcode;
+};
+
+struct PartitionOutput {
+    SmallVector<char, 0> Code;
+    std::string Error;
+};
+
+// Partition of each global definition, in order of the partition index
+struct PartitionPlan {
+    DenseMap<const GlobalValue *, unsigned> PartitionOf;
+    unsigned NumPartitions = 1;
+};
+
+std::optional<unsigned> getPartitionMetadata(const Function &F) {
+    const MDNode *Node = F.getMetadata("codegen.partition");
+    if(!Node || Node->getNumOperands() == 0) {
+        return std::nullopt;
+    }
+    if(const auto *Partition = mdconst::dyn_extract<ConstantInt>(Node->getOperand(0))) {
+        return Partition->getZExtValue();
+    }
+    return std::nullopt;
+}
+
+/*
+Partition metadata of the functions of a lazily loaded module, by function name.
+Bodies, and with them their metadata attachments, are read one at a time into a
+second lazy module and deleted again.
+*/
+Expected<StringMap<unsigned>> scanPartitionMetadata(MemoryBufferRef Bitcode) {
+    LLVMContext Context;
+    Expected<std::unique_ptr<Module>> M = getLazyBitcodeModule(Bitcode, Context);
+    if(!M) {
+        return M.takeError();
+    }
+
+    StringMap<unsigned> Partitions;
+    for(Function &F: **M) {
+        if(!F.isMaterializable()) {
+            continue;
+        }
+        if(Error E = F.materialize()) {
+            return std::move(E);
+        }
+        if(std::optional<unsigned> Partition = getPartitionMetadata(F)) {
+            Partitions[F.getName()] = *Partition;
+        }
+        F.deleteBody();
+    }
+    return std::move(Partitions);
+}
+
+using PartitionLookup = function_ref<std::optional<unsigned>(const Function &)>;
+
+PartitionPlan planPartitions(const Module &M, PartitionLookup getPartition) {
+    PartitionPlan Plan;
+    if(Split == SplitMode::None) {
+        return Plan;
+    }
+
+    bool UseMetadata = Split == SplitMode::Auto && llvm::any_of(M, [&](const Function &F) {
+        return getPartition(F).has_value();
+    });
+
+    // Raw partition ids, renumbered densely in order of first appearance below
+    DenseMap<const GlobalValue *, unsigned> RawPartition;
+    DenseMap<const Comdat *, unsigned> ComdatPartition;
+    unsigned NextRaw = 0;
+    for(const Function &F: M) {
+        if(F.isDeclaration()) {
+            continue;
+        }
+        unsigned Raw;
+        if(const Comdat *C = F.getComdat(); C && ComdatPartition.count(C)) {
+            Raw = ComdatPartition[C];
+        } else if(UseMetadata) {
+            Raw = getPartition(F).value_or(0);
+        } else {
+            Raw = NextRaw++;
+        }
+        if(const Comdat *C = F.getComdat()) {
+            ComdatPartition.try_emplace(C, Raw);
+        }
+        RawPartition[&F] = Raw;
+    }
+
+    for(const GlobalVariable &GV: M.globals()) {
+        if(GV.isDeclaration()) {
+            continue;
+        }
+        const Comdat *C = GV.getComdat();
+        RawPartition[&GV] = C && ComdatPartition.count(C) ? ComdatPartition[C] : 0;
+    }
+    auto getTarget = [&](const GlobalObject *Target) {
+        return Target ? RawPartition.lookup(Target) : 0;
+    };
+    for(const GlobalAlias &GA: M.aliases()) {
+        RawPartition[&GA] = getTarget(GA.getAliaseeObject());
+    }
+    for(const GlobalIFunc &GI: M.ifuncs()) {
+        RawPartition[&GI] = getTarget(GI.getResolverFunction());
+    }
+
+    // Dense numbering, partitions without definitions dropped
+    std::map<unsigned, unsigned> Dense;
+    for(const auto &[GV, Raw]: RawPartition) {
+        Dense.emplace(Raw, 0);
+    }
+    unsigned Index = 0;
+    for(auto &[Raw, DenseIndex]: Dense) {
+        DenseIndex = Index++;
+    }
+    for(const auto &[GV, Raw]: RawPartition) {
+        Plan.PartitionOf[GV] = Dense[Raw];
+    }
+    Plan.NumPartitions = std::max<unsigned>(Dense.size(), 1);
+    return Plan;
+}
+
+// Give every symbol a partition may refer to from another one an external name.
+void externalizeLocals(Module &M) {
+    auto externalize = [](GlobalValue &GV) {
+        if(GV.hasLocalLinkage()) {
+            GV.setLinkage(GlobalValue::ExternalLinkage);
+            GV.setVisibility(GlobalValue::HiddenVisibility);
+        }
+        if(!GV.hasName()) {
+            GV.setName("__regalloc_driver_unnamed");
+        }
+    };
+    for(GlobalValue &GV: M.global_values()) {
+        externalize(GV);
+    }
+}
+
+/*
+Clone the definitions of one partition, everything else becomes a declaration.
+In a lazily loaded module the bodies of the partition are read first and deleted
+once cloned, no later partition needs them.
+*/
+Expected<SmallVector<char, 0>> extractPartition(Module &M, const PartitionPlan &Plan, unsigned Index) {
+    SmallVector<Function *, 4> Materialized;
+    for(Function &F: M) {
+        if(F.isMaterializable() && Plan.PartitionOf.lookup(&F) == Index) {
+            if(Error E = F.materialize()) {
+                return std::move(E);
+            }
+            Materialized.push_back(&F);
+        }
+    }
+
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Part = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+        return Plan.PartitionOf.lookup(GV) == Index;
+    });
+
+    for(Function *F: Materialized) {
+        F->deleteBody();
+    }
+
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(*Part, OS);
+    return std::move(Bitcode);
+}
+
+void runWorker(BoundedQueue<PartitionInput> &Inputs, ReorderBuffer<PartitionOutput> &Outputs) {
+    // One per thread, code generation state is not shared between threads.
+    std::unique_ptr<TargetMachine> TM;
+    while(std::optional<PartitionInput> Input = Inputs.pop()) {
+        PartitionOutput Output;
+        LLVMContext Context;
+        Expected<std::unique_ptr<Module>> M = parseBitcodeFile(
+            MemoryBufferRef(StringRef(Input->Bitcode.data(), Input->Bitcode.size()), "partition"), Context);
+        Error E = M.takeError();
+        if(!E && !TM) {
+            Expected<std::unique_ptr<TargetMachine>> Created = regalloc::createTargetMachine(**M, CPU, Features);
+            if(Created) {
+                TM = std::move(*Created);
+            } else {
+                E = Created.takeError();
+            }
+        }
+        if(!E) {
+            raw_svector_ostream OS(Output.Code);
+            E = regalloc::runCodeGen(**M, *TM, Allocator, {}, OS, FileType);
+        }
+        if(E) {
+            Output.Error = toString(std::move(E));
+        }
+
+        Input->Bitcode = SmallVector<char, 0>();
+        Outputs.put(Input->Index, std::move(Output));
+    }
+}
+
+std::string getOutputName(unsigned Index, unsigned NumPartitions) {
+    if(NumPartitions == 1) {
+        return OutputFile;
+    }
+    return OutputFile + "." + std::to_string(Index);
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    regalloc::initializeLLVM();
+    cl::ParseCommandLineOptions(argc, argv, "Pipelined codegen with the Minimal Register Allocator\n");
+
+    // Outlives the lazily loaded module, which reads function bodies from it
+    std::unique_ptr<MemoryBuffer> Bitcode;
+    if(LazyLoad) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFileOrSTDIN(InputFile);
+        if(!Buffer) {
+            WithColor::error() << InputFile << ": " << Buffer.getError().message() << "\n";
+            return 1;
+        }
+        if(isBitcode(reinterpret_cast<const unsigned char *>((*Buffer)->getBufferStart()),
+                     reinterpret_cast<const unsigned char *>((*Buffer)->getBufferEnd()))) {
+            Bitcode = std::move(*Buffer);
+        }
+    }
+
+    LLVMContext Context;
+    Expected<std::unique_ptr<Module>> M = Bitcode ? getLazyBitcodeModule(Bitcode->getMemBufferRef(), Context)
+                                                  : regalloc::loadModule(InputFile, Context);
+    if(!M) {
+        WithColor::error() << InputFile << ": " << toString(M.takeError()) << "\n";
+        return 1;
+    }
+    // Fixes the triple and data layout every partition inherits
+    if(Expected<std::unique_ptr<TargetMachine>> TM = regalloc::createTargetMachine(**M, CPU, Features); !TM) {
+        WithColor::error() << toString(TM.takeError()) << "\n";
+        return 1;
+    }
+
+    // Workers only read the allocator default, set it before they start.
+    Expected<RegisterRegAlloc::FunctionPassCtor> Ctor = regalloc::lookupRegisterAllocator(Allocator);
+    if(!Ctor) {
+        WithColor::error() << toString(Ctor.takeError()) << "\n";
+        return 1;
+    }
+    RegisterRegAlloc::setDefault(*Ctor);
+
+    // Function metadata of a lazy module is only there once its body is read.
+    StringMap<unsigned> ScannedPartitions;
+    if(Bitcode && Split == SplitMode::Auto && (*M)->getNamedMetadata("codegen.partitions")) {
+        Expected<StringMap<unsigned>> Scanned = scanPartitionMetadata(Bitcode->getMemBufferRef());
+        if(!Scanned) {
+            WithColor::error() << InputFile << ": " << toString(Scanned.takeError()) << "\n";
+            return 1;
+        }
+        ScannedPartitions = std::move(*Scanned);
+    }
+    PartitionPlan Plan = planPartitions(**M, [&](const Function &F) -> std::optional<unsigned> {
+        if(!Bitcode) {
+            return getPartitionMetadata(F);
+        }
+        auto It = ScannedPartitions.find(F.getName());
+        if(It == ScannedPartitions.end()) {
+            return std::nullopt;
+        }
+        return It->second;
+    });
+    if(Plan.NumPartitions > 1) {
+        externalizeLocals(**M);
+    }
+
+    unsigned NumThreads = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+    NumThreads = std::min(NumThreads, Plan.NumPartitions);
+    unsigned Depth = QueueDepth ? QueueDepth : 2 * NumThreads;
+    BoundedQueue<PartitionInput> Inputs(Depth);
+    ReorderBuffer<PartitionOutput> Outputs(Depth + NumThreads);
+
+    std::vector<std::thread> Workers;
+    for(unsigned Thread = 0; Thread < NumThreads; Thread++) {
+        Workers.emplace_back(runWorker, std::ref(Inputs), std::ref(Outputs));
+    }
+
+    bool Failed = false;
+    std::thread Writer([&]() {
+        for(unsigned Index = 0; Index < Plan.NumPartitions; Index++) {
+            PartitionOutput Output = Outputs.take();
+            std::string Name = getOutputName(Index, Plan.NumPartitions);
+            if(!Output.Error.empty()) {
+                WithColor::error() << Name << ": " << Output.Error << "\n";
+                Failed = true;
+                continue;
+            }
+
+            std::error_code EC;
+            raw_fd_ostream OS(Name, EC, FileType == CodeGenFileType::AssemblyFile ? sys::fs::OF_Text
+                                                                                   : sys::fs::OF_None);
+            if(EC) {
+                WithColor::error() << Name << ": " << EC.message() << "\n";
+                Failed = true;
+                continue;
+            }
+            OS.write(Output.Code.data(), Output.Code.size());
+        }
+    });
+
+    for(unsigned Index = 0; Index < Plan.NumPartitions; Index++) {
+        Expected<SmallVector<char, 0>> Part = extractPartition(**M, Plan, Index);
+        if(!Part) {
+            // Workers and writer still expect every partition, hand over an empty one.
+            WithColor::error() << InputFile << ": " << toString(Part.takeError()) << "\n";
+            Inputs.push({Index, SmallVector<char, 0>()});
+            continue;
+        }
+        Inputs.push({Index, std::move(*Part)});
+    }
+    Inputs.close();
+
+    for(std::thread &Worker: Workers) {
+        Worker.join();
+    }
+    Writer.join();
+    return Failed ? 1 : 0;
+}
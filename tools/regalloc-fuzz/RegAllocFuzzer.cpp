@@ -0,0 +1,216 @@
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/FuzzMutate/FuzzerCLI.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "CodeGenSupport.h"
+#include "SyntheticIR.h"
+
+#include "atomic"
+#include "chrono"
+#include "cmath"
+#include "cstdlib"
+#include "thread"
+
+using namespace llvm;
+
+/*
+regalloc-fuzz: libFuzzer harness hunting compile-time pathologies of the allocator.
+
+Each input is the shape of a synthetic function (see SyntheticIR.h). The shape is
+compiled at two scales, Scale and Scale * ScaleFactor, and the growth of compile
+time and peak heap usage is compared with the growth of the function:
+
+    exponent = log(time ratio) / log(instruction count ratio)
+
+Linear behaviour gives an exponent near 1 and quadratic behaviour one near 2.
+When an exponent passes its threshold, the generated IR of the larger function
+is written to the reproducer directory and the harness aborts, so libFuzzer keeps
+the input. Running libFuzzer with -minimize_crash=1 on that input shrinks the
+shape, writing a smaller reproducer for every step.
+
+    regalloc-fuzz corpus/ -ignore_remaining_args=1 -regalloc-fuzz-reproducer-dir=repro
+    regalloc-fuzz -minimize_crash=1 -runs=10000 crash-<hash> -ignore_remaining_args=1 ...
+
+Options of the harness go after -ignore_remaining_args=1, libFuzzer reads the
+ones before. The whole codegen pipeline is timed, not only the allocator, so a
+pathology elsewhere in codegen shows up as well; the reproducer tells which.
+*/
+
+static cl::opt<std::string> Allocator("regalloc-fuzz-allocator", cl::desc("Register allocator to fuzz"),
+                                      cl::init("register-allocator-minimal"));
+
+static cl::opt<std::string> TargetTriple("regalloc-fuzz-triple", cl::desc("Target triple, default the host"),
+                                         cl::init(""));
+
+static cl::opt<std::string> CPU("regalloc-fuzz-mcpu", cl::desc("Target CPU"), cl::init(""));
+
+static cl::opt<unsigned> Scale("regalloc-fuzz-scale", cl::desc("Repetitions of the shape in the smaller function"),
+                               cl::init(4));
+
+static cl::opt<unsigned> ScaleFactor("regalloc-fuzz-scale-factor",
+                                     cl::desc("Size ratio between the larger and the smaller function"), cl::init(4));
+
+static cl::opt<double> MaxTimeExponent("regalloc-fuzz-max-time-exponent",
+                                       cl::desc("Largest accepted growth exponent of compile time"), cl::init(1.5));
+
+static cl::opt<double> MaxMemoryExponent("regalloc-fuzz-max-memory-exponent",
+                                         cl::desc("Largest accepted growth exponent of peak heap usage"),
+                                         cl::init(1.5));
+
+static cl::opt<double> MinSeconds("regalloc-fuzz-min-seconds",
+                                  cl::desc("Compile times below this are too noisy to judge"), cl::init(0.05));
+
+static cl::opt<unsigned> MinMemoryKB("regalloc-fuzz-min-memory-kb",
+                                     cl::desc("Heap growth below this is too noisy to judge"), cl::init(4096));
+
+static cl::opt<std::string> ReproducerDir("regalloc-fuzz-reproducer-dir",
+                                          cl::desc("Directory for the IR of offending inputs"), cl::init("."));
+
+namespace {
+
+std::unique_ptr<TargetMachine> TM;
+
+struct Measurement {
+    unsigned Instructions;
+    double Seconds;
+    size_t PeakBytes;
+};
+
+/*
+Compile M and measure wall time and the peak heap usage above what was in use
+before. The peak is sampled by a thread while codegen runs, short spikes between
+two samples are missed.
+*/
+Measurement measure(Module &M) {
+    Measurement Result;
+    Result.Instructions = M.getFunction("synthetic")->getInstructionCount();
+
+    size_t Baseline = sys::Process::GetMallocUsage();
+    std::atomic<bool> Done(false);
+    std::atomic<size_t> Peak(Baseline);
+    std::thread Sampler([&]() {
+        while(!Done.load(std::memory_order_relaxed)) {
+            size_t Usage = sys::Process::GetMallocUsage();
+            if(Usage > Peak.load(std::memory_order_relaxed)) {
+                Peak.store(Usage, std::memory_order_relaxed);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    auto Start = std::chrono::steady_clock::now();
+    raw_null_ostream Null;
+    Error E = regalloc::runCodeGen(M, *TM, Allocator, {}, Null, CodeGenFileType::Null);
+    auto End = std::chrono::steady_clock::now();
+    Done = true;
+    Sampler.join();
+
+    if(E) {
+        WithColor::error() << toString(std::move(E)) << "\n";
+        std::abort();
+    }
+    Result.Seconds = std::chrono::duration<double>(End - Start).count();
+    Result.PeakBytes = Peak - Baseline;
+    return Result;
+}
+
+double getExponent(double Small, double Large, double SmallSize, double LargeSize) {
+    if(Small <= 0 || LargeSize <= SmallSize) {
+        return 0;
+    }
+    return std::log(Large / Small) / std::log(LargeSize / SmallSize);
+}
+
+std::unique_ptr<Module> generate(ArrayRef<uint8_t> Shape, unsigned Repetitions, LLVMContext &Context) {
+    std::unique_ptr<Module> M = regalloc::generateSyntheticModule(Shape, Repetitions, Context);
+    M->setTargetTriple(TM->getTargetTriple().str());
+    M->setDataLayout(TM->createDataLayout());
+    return M;
+}
+
+void writeReproducer(ArrayRef<uint8_t> Shape, const Module &M, StringRef Reason) {
+    std::string Name = "regalloc-fuzz-" + utohexstr(xxh3_64bits(Shape), /*LowerCase=*/true, 16) + ".ll";
+    SmallString<128> Path(ReproducerDir);
+    sys::path::append(Path, Name);
+
+    std::error_code EC = sys::fs::create_directories(ReproducerDir);
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+    if(EC) {
+        WithColor::error() << Path << ": " << EC.message() << "\n";
+        return;
+    }
+    OS << "; " << Reason << "\n";
+    M.print(OS, nullptr);
+    errs() << "reproducer written to " << Path << "\n";
+}
+
+}
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    regalloc::initializeLLVM();
+    parseFuzzerCLOpts(*argc, *argv);
+
+    LLVMContext Context;
+    Module Probe("probe", Context);
+    Probe.setTargetTriple(TargetTriple);
+    Expected<std::unique_ptr<TargetMachine>> Created = regalloc::createTargetMachine(Probe, CPU, "");
+    if(!Created) {
+        WithColor::error() << toString(Created.takeError()) << "\n";
+        std::exit(1);
+    }
+    TM = std::move(*Created);
+
+    if(Scale == 0 || ScaleFactor < 2) {
+        WithColor::error() << "-regalloc-fuzz-scale must be at least 1 and -regalloc-fuzz-scale-factor at least 2\n";
+        std::exit(1);
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+    ArrayRef<uint8_t> Shape(Data, Size);
+
+    LLVMContext SmallContext;
+    std::unique_ptr<Module> Small = generate(Shape, Scale, SmallContext);
+    Measurement SmallRun = measure(*Small);
+
+    LLVMContext LargeContext;
+    std::unique_ptr<Module> Large = generate(Shape, Scale * ScaleFactor, LargeContext);
+    Measurement LargeRun = measure(*Large);
+
+    double TimeExponent = getExponent(SmallRun.Seconds, LargeRun.Seconds, SmallRun.Instructions,
+                                      LargeRun.Instructions);
+    double MemoryExponent = getExponent(SmallRun.PeakBytes, LargeRun.PeakBytes, SmallRun.Instructions,
+                                        LargeRun.Instructions);
+
+    std::string Reason;
+    if(LargeRun.Seconds >= MinSeconds && TimeExponent > MaxTimeExponent) {
+        Reason = formatv("compile time grows with exponent {0:F2}: {1:F3}s for {2} instructions, "
+                         "{3:F3}s for {4}",
+                         TimeExponent, SmallRun.Seconds, SmallRun.Instructions, LargeRun.Seconds,
+                         LargeRun.Instructions).str();
+    } else if(LargeRun.PeakBytes >= MinMemoryKB * 1024 && MemoryExponent > MaxMemoryExponent) {
+        Reason = formatv("peak heap grows with exponent {0:F2}: {1} KB for {2} instructions, {3} KB for {4}",
+                         MemoryExponent, SmallRun.PeakBytes / 1024, SmallRun.Instructions,
+                         LargeRun.PeakBytes / 1024, LargeRun.Instructions).str();
+    }
+    if(Reason.empty()) {
+        return 0;
+    }
+
+    errs() << "regalloc-fuzz: " << Reason << "\n";
+    // Codegen rewrote the measured module, print a fresh one.
+    LLVMContext ReproContext;
+    writeReproducer(Shape, *generate(Shape, Scale * ScaleFactor, ReproContext), Reason);
+    std::abort();
+}
@@ -0,0 +1,308 @@
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+#include "SyntheticIR.h"
+
+#include "algorithm"
+#include "vector"
+
+using namespace llvm;
+
+namespace {
+
+// Longest unit the bytes can describe
+constexpr size_t MaxOps = 4096;
+
+// Regions nest at most this deep, loops at most MaxLoopDepth of them
+constexpr unsigned MaxRegionDepth = 8;
+constexpr unsigned MaxLoopDepth = 3;
+
+enum OpKind : uint8_t {
+    IntArith,
+    FloatArith,
+    Load,
+    Store,
+    Call,
+    Convert,
+    LoopBegin,
+    LoopEnd,
+    IfBegin,
+    IfEnd,
+    NumOpKinds
+};
+
+// One operation of the unit, A and B select operands or variants
+struct Op {
+    OpKind Kind;
+    uint8_t A;
+    uint8_t B;
+};
+
+// Reads the shape bytes, zeros once they run out
+class ShapeReader {
+private:
+    ArrayRef<uint8_t> Bytes;
+    size_t Pos = 0;
+
+public:
+    ShapeReader(ArrayRef<uint8_t> Bytes) : Bytes(Bytes) {}
+
+    bool empty() const {
+        return Pos >= Bytes.size();
+    }
+
+    uint8_t next() {
+        return Pos < Bytes.size() ? Bytes[Pos++] : 0;
+    }
+};
+
+// Open loop or if-then region
+struct Region {
+    bool IsLoop;
+    // Induction variable of a loop, its parent block is the loop header
+    PHINode *Counter;
+    // Block that branches around the then block of an if-then region, and where both meet
+    BasicBlock *Head;
+    BasicBlock *Merge;
+    // Pool sizes when the region was opened, values defined in a then block end with it
+    size_t NumInts;
+    size_t NumFloats;
+};
+
+class Generator {
+private:
+    LLVMContext &Context;
+    Function *F;
+    IRBuilder<> B;
+    Value *Mem;
+    Value *N;
+    FunctionCallee External;
+
+    // Operands are picked among the last Window values of each pool.
+    unsigned Window;
+    std::vector<Value *> Ints;
+    std::vector<Value *> Floats;
+    std::vector<Region> Regions;
+
+    Value *pick(const std::vector<Value *> &Pool, uint8_t Select) const {
+        size_t Live = std::min<size_t>(Window, Pool.size());
+        return Pool[Pool.size() - 1 - Select % Live];
+    }
+
+    Value *getAddress(uint8_t Offset) {
+        return B.CreateInBoundsGEP(B.getInt64Ty(), Mem, B.getInt64(Offset));
+    }
+
+    unsigned getLoopDepth() const {
+        return llvm::count_if(Regions, [](const Region &R) { return R.IsLoop; });
+    }
+
+    void openLoop() {
+        BasicBlock *Preheader = B.GetInsertBlock();
+        BasicBlock *Header = BasicBlock::Create(Context, "loop", F);
+        B.CreateBr(Header);
+        B.SetInsertPoint(Header);
+
+        PHINode *Counter = B.CreatePHI(B.getInt64Ty(), 2, "i");
+        Counter->addIncoming(B.getInt64(0), Preheader);
+        Regions.push_back({true, Counter, nullptr, nullptr, Ints.size(), Floats.size()});
+        Ints.push_back(Counter);
+    }
+
+    void closeLoop() {
+        Region R = Regions.back();
+        Regions.pop_back();
+
+        Value *Next = B.CreateAdd(R.Counter, B.getInt64(1));
+        Value *Continue = B.CreateICmpULT(Next, N);
+        BasicBlock *Latch = B.GetInsertBlock();
+        BasicBlock *Exit = BasicBlock::Create(Context, "exit", F);
+        B.CreateCondBr(Continue, R.Counter->getParent(), Exit);
+        R.Counter->addIncoming(Next, Latch);
+        B.SetInsertPoint(Exit);
+    }
+
+    void openIf(uint8_t Left, uint8_t Right) {
+        Value *Cond = B.CreateICmpSLT(pick(Ints, Left), pick(Ints, Right));
+        BasicBlock *Head = B.GetInsertBlock();
+        BasicBlock *Then = BasicBlock::Create(Context, "then", F);
+        // Inserted into the function when the region closes, to keep the block order readable
+        BasicBlock *Merge = BasicBlock::Create(Context, "merge");
+        B.CreateCondBr(Cond, Then, Merge);
+        B.SetInsertPoint(Then);
+        Regions.push_back({false, nullptr, Head, Merge, Ints.size(), Floats.size()});
+    }
+
+    void closeIf(uint8_t Select) {
+        Region R = Regions.back();
+        Regions.pop_back();
+
+        Value *Inner = pick(Ints, Select);
+        BasicBlock *ThenEnd = B.GetInsertBlock();
+        B.CreateBr(R.Merge);
+
+        Ints.resize(R.NumInts);
+        Floats.resize(R.NumFloats);
+        Value *Outer = pick(Ints, Select);
+
+        R.Merge->insertInto(F);
+        B.SetInsertPoint(R.Merge);
+        PHINode *Phi = B.CreatePHI(B.getInt64Ty(), 2);
+        Phi->addIncoming(Inner, ThenEnd);
+        Phi->addIncoming(Outer, R.Head);
+        Ints.push_back(Phi);
+    }
+
+    void closeRegions() {
+        while(!Regions.empty()) {
+            if(Regions.back().IsLoop) {
+                closeLoop();
+            } else {
+                closeIf(0);
+            }
+        }
+    }
+
+    void emit(const Op &O) {
+        switch(O.Kind) {
+            case IntArith: {
+                Value *Left = pick(Ints, O.A);
+                Value *Right = pick(Ints, O.B);
+                switch((O.A ^ O.B) % 4) {
+                    case 0:
+                    Ints.push_back(B.CreateAdd(Left, Right));
+                    break;
+                    case 1:
+                    Ints.push_back(B.CreateSub(Left, Right));
+                    break;
+                    case 2:
+                    Ints.push_back(B.CreateMul(Left, Right));
+                    break;
+                    default:
+                    Ints.push_back(B.CreateXor(Left, Right));
+                    break;
+                }
+                break;
+            }
+            case FloatArith: {
+                Value *Left = pick(Floats, O.A);
+                Value *Right = pick(Floats, O.B);
+                Floats.push_back(O.A % 2 ? B.CreateFMul(Left, Right) : B.CreateFAdd(Left, Right));
+                break;
+            }
+            case Load:
+            if(O.A % 2) {
+                Floats.push_back(B.CreateLoad(B.getDoubleTy(), getAddress(O.B)));
+            } else {
+                Ints.push_back(B.CreateLoad(B.getInt64Ty(), getAddress(O.B)));
+            }
+            break;
+            case Store:
+            B.CreateStore(O.A % 2 ? pick(Floats, O.A / 2) : pick(Ints, O.A / 2), getAddress(O.B));
+            break;
+            case Call:
+            // Clobbers every caller-saved register while the window is live
+            Ints.push_back(B.CreateCall(External, {pick(Ints, O.A), pick(Floats, O.B)}));
+            break;
+            case Convert:
+            if(O.A % 2) {
+                Floats.push_back(B.CreateSIToFP(pick(Ints, O.B), B.getDoubleTy()));
+            } else {
+                Ints.push_back(B.CreateFPToSI(pick(Floats, O.B), B.getInt64Ty()));
+            }
+            break;
+            case LoopBegin:
+            if(Regions.size() < MaxRegionDepth && getLoopDepth() < MaxLoopDepth) {
+                openLoop();
+            }
+            break;
+            case LoopEnd:
+            if(!Regions.empty() && Regions.back().IsLoop) {
+                closeLoop();
+            }
+            break;
+            case IfBegin:
+            if(Regions.size() < MaxRegionDepth) {
+                openIf(O.A, O.B);
+            }
+            break;
+            case IfEnd:
+            if(!Regions.empty() && !Regions.back().IsLoop) {
+                closeIf(O.A);
+            }
+            break;
+            case NumOpKinds:
+            break;
+        }
+    }
+
+public:
+    Generator(Module &M, unsigned Window) : Context(M.getContext()), B(M.getContext()), Window(Window) {
+        Type *Int64 = Type::getInt64Ty(Context);
+        Type *Double = Type::getDoubleTy(Context);
+        FunctionType *Signature = FunctionType::get(Int64, {PointerType::get(Context, 0), Int64}, false);
+        F = Function::Create(Signature, Function::ExternalLinkage, "synthetic", M);
+        External = M.getOrInsertFunction("external", FunctionType::get(Int64, {Int64, Double}, false));
+
+        Mem = F->getArg(0);
+        N = F->getArg(1);
+        B.SetInsertPoint(BasicBlock::Create(Context, "entry", F));
+        Ints.push_back(N);
+        Ints.push_back(B.CreateLoad(Int64, Mem));
+        Floats.push_back(B.CreateSIToFP(N, Double));
+    }
+
+    // Emit one repetition of the unit, leaving no region open.
+    void emitUnit(ArrayRef<Op> Ops) {
+        for(const Op &O: Ops) {
+            emit(O);
+        }
+        closeRegions();
+    }
+
+    // Fold the live window into the return value.
+    void finish() {
+        closeRegions();
+
+        Value *Result = B.getInt64(0);
+        for(size_t Idx = Ints.size() - std::min<size_t>(Window, Ints.size()); Idx < Ints.size(); Idx++) {
+            Result = B.CreateXor(Result, Ints[Idx]);
+        }
+        Value *Sum = ConstantFP::get(B.getDoubleTy(), 0.0);
+        for(size_t Idx = Floats.size() - std::min<size_t>(Window, Floats.size()); Idx < Floats.size(); Idx++) {
+            Sum = B.CreateFAdd(Sum, Floats[Idx]);
+        }
+        Result = B.CreateXor(Result, B.CreateFPToSI(Sum, B.getInt64Ty()));
+        B.CreateRet(Result);
+    }
+};
+
+}
+
+std::unique_ptr<Module> regalloc::generateSyntheticModule(ArrayRef<uint8_t> Shape, unsigned Scale,
+                                                          LLVMContext &Context) {
+    ShapeReader Reader(Shape);
+    unsigned Window = 2 + 2 * unsigned(Reader.next());
+
+    std::vector<Op> Ops;
+    while(!Reader.empty() && Ops.size() < MaxOps) {
+        Op O;
+        O.Kind = OpKind(Reader.next() % NumOpKinds);
+        O.A = Reader.next();
+        O.B = Reader.next();
+        Ops.push_back(O);
+    }
+
+    auto M = std::make_unique<Module>("synthetic", Context);
+    Generator Gen(*M, Window);
+    for(unsigned Rep = 0; Rep < Scale; Rep++) {
+        Gen.emitUnit(Ops);
+    }
+    Gen.finish();
+    return M;
+}
@@ -0,0 +1,37 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_SYNTHETIC_IR_H
+#define REGISTER_ALLOCATOR_MINIMAL_SYNTHETIC_IR_H
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include "cstdint"
+#include "memory"
+
+namespace llvm {
+
+class LLVMContext;
+class Module;
+
+namespace regalloc {
+
+/*
+Synthetic IR generator driven by a byte string, for compile-time fuzzing of the
+allocator.
+
+The bytes describe one unit of code: how many values stay live at once, then a
+sequence of operations (integer and floating point arithmetic, loads, stores,
+calls, conversions, loops and if-then regions). The generated function repeats
+the unit Scale times, so the same bytes give functions whose size grows linearly
+with Scale while the shape of the live ranges stays the same. That is what lets
+the fuzzer tell linear from superlinear compile time.
+
+Every value the unit keeps in its live window is folded into the return value,
+so nothing is dead code before register allocation.
+
+    define i64 @synthetic(ptr %mem, i64 %n)
+*/
+std::unique_ptr<Module> generateSyntheticModule(ArrayRef<uint8_t> Shape, unsigned Scale, LLVMContext &Context);
+
+}
+}
+
+#endif
@@ -0,0 +1,260 @@
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "CodeGenSupport.h"
+#include "RegisterAllocator.h"
+
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "optional"
+#include "thread"
+
+using namespace llvm;
+
+/*
+regalloc-jit: tiered JIT compilation with the Minimal Register Allocator, for
+measuring what the tiers buy a JIT.
+
+The module is JITed with ORC's LLJIT, every function tagged with the
+"regalloc-minimal-tier" attribute (see RegAllocMinimalTierAttr):
+
+    1. tier 0: "fast", timed from parsing to the return of the first call of the
+       entry function
+    2. the same with "full" up front, for comparison
+    3. tiered: the entry runs from the tier-0 code, and once it was called
+       -hot-calls times a background thread recompiles the module with "full".
+       The entry pointer is swapped when that compile is done, calls keep going
+       through the tier-0 code meanwhile.
+    4. steady state: -calls calls of each tier's code, per call time
+
+Each compile gets its own LLJIT instance, so the swap replaces the whole module
+rather than single functions: the kernels have one hot entry, and it keeps the
+harness free of ORC's lazy reexports.
+
+The entry function takes integer arguments only, given with -args (missing ones
+are 0). It is called through a generated void() wrapper that stores its result
+to a volatile global.
+
+    clang -O1 -emit-llvm -c add.c -o add.bc
+    regalloc-jit -entry=add -args=1,2 add.bc
+*/
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<input bitcode or IR>"));
+
+static cl::opt<std::string> EntryName("entry", cl::Required, cl::desc("Function to call"));
+
+static cl::list<long long> Args("args", cl::CommaSeparated, cl::desc("Integer arguments of the entry function"));
+
+static cl::opt<unsigned> HotCalls("hot-calls", cl::desc("Calls of the tier-0 code before the recompile starts"),
+                                  cl::init(1000));
+
+static cl::opt<unsigned> Calls("calls", cl::desc("Calls per tier in the steady state measurement"),
+                               cl::init(100000));
+
+namespace {
+
+using EntryFn = void (*)();
+
+constexpr StringRef WrapperName = "__regalloc_jit_entry";
+
+struct TierJIT {
+    std::unique_ptr<orc::LLJIT> JIT;
+    EntryFn Entry = nullptr;
+};
+
+double secondsSince(std::chrono::steady_clock::time_point Start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+// void WrapperName() { volatile store Entry(Args...) }
+Error addEntryWrapper(Module &M) {
+    Function *Entry = M.getFunction(EntryName);
+    if(!Entry || Entry->isDeclaration()) {
+        return createStringError(inconvertibleErrorCode(), "no definition of '%s'", EntryName.c_str());
+    }
+
+    LLVMContext &Context = M.getContext();
+    SmallVector<Value *, 4> CallArgs;
+    for(Argument &Arg: Entry->args()) {
+        IntegerType *Ty = dyn_cast<IntegerType>(Arg.getType());
+        if(!Ty) {
+            return createStringError(inconvertibleErrorCode(), "argument %u of '%s' is not an integer",
+                                     Arg.getArgNo(), EntryName.c_str());
+        }
+        long long Value = Arg.getArgNo() < Args.size() ? Args[Arg.getArgNo()] : 0;
+        CallArgs.push_back(ConstantInt::get(Ty, Value, /*IsSigned=*/true));
+    }
+
+    Function *Wrapper = Function::Create(FunctionType::get(Type::getVoidTy(Context), false),
+                                         GlobalValue::ExternalLinkage, WrapperName, M);
+    IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Wrapper));
+    CallInst *Call = Builder.CreateCall(Entry, CallArgs);
+    if(!Call->getType()->isVoidTy()) {
+        auto *Result = new GlobalVariable(M, Call->getType(), /*isConstant=*/false, GlobalValue::InternalLinkage,
+                                          Constant::getNullValue(Call->getType()), "__regalloc_jit_result");
+        Builder.CreateStore(Call, Result, /*isVolatile=*/true);
+    }
+    Builder.CreateRetVoid();
+    return Error::success();
+}
+
+// Parse, tag and JIT the module, returns once the entry is compiled.
+Expected<TierJIT> compileTier(const MemoryBuffer &Input, StringRef Tier) {
+    auto Context = std::make_unique<LLVMContext>();
+    SMDiagnostic Diag;
+    std::unique_ptr<Module> M = parseIR(Input.getMemBufferRef(), Diag, *Context);
+    if(!M) {
+        std::string Message;
+        raw_string_ostream OS(Message);
+        Diag.print("", OS, /*ShowColors=*/false);
+        return createStringError(inconvertibleErrorCode(), OS.str());
+    }
+    if(Error E = addEntryWrapper(*M)) {
+        return std::move(E);
+    }
+    for(Function &F: *M) {
+        if(!F.isDeclaration()) {
+            F.addFnAttr(RegAllocMinimalTierAttr, Tier);
+        }
+    }
+
+    TierJIT Result;
+    Expected<std::unique_ptr<orc::LLJIT>> JIT = orc::LLJITBuilder().create();
+    if(!JIT) {
+        return JIT.takeError();
+    }
+    Result.JIT = std::move(*JIT);
+    if(Error E = Result.JIT->addIRModule(orc::ThreadSafeModule(std::move(M), std::move(Context)))) {
+        return std::move(E);
+    }
+    Expected<orc::ExecutorAddr> Address = Result.JIT->lookup(WrapperName);
+    if(!Address) {
+        return Address.takeError();
+    }
+    Result.Entry = Address->toPtr<EntryFn>();
+    return std::move(Result);
+}
+
+// Compile, then call the entry once. Prints and returns the time to first execution.
+Expected<TierJIT> measureFirstExecution(const MemoryBuffer &Input, StringRef Tier) {
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    Expected<TierJIT> Compiled = compileTier(Input, Tier);
+    if(!Compiled) {
+        return Compiled.takeError();
+    }
+    double CompileSeconds = secondsSince(Start);
+    Compiled->Entry();
+    double FirstSeconds = secondsSince(Start);
+
+    outs() << format("%-6s compile %10.3f ms, first execution %10.3f ms\n", Tier.str().c_str(),
+                     CompileSeconds * 1e3, FirstSeconds * 1e3);
+    return Compiled;
+}
+
+double measureSteadyState(EntryFn Entry) {
+    // Warm up caches and branch predictors
+    for(unsigned Call = 0; Call < std::min(Calls.getValue(), 1000u); Call++) {
+        Entry();
+    }
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    for(unsigned Call = 0; Call < Calls; Call++) {
+        Entry();
+    }
+    return secondsSince(Start) / std::max(Calls.getValue(), 1u);
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    regalloc::initializeLLVM();
+    cl::ParseCommandLineOptions(argc, argv, "Tiered JIT compilation with the Minimal Register Allocator\n");
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Input = MemoryBuffer::getFileOrSTDIN(InputFile);
+    if(!Input) {
+        WithColor::error() << InputFile << ": " << Input.getError().message() << "\n";
+        return 1;
+    }
+
+    // The JIT's codegen pipelines only read the allocator default, set it before any compile.
+    Expected<RegisterRegAlloc::FunctionPassCtor> Ctor = regalloc::lookupRegisterAllocator("register-allocator-minimal");
+    if(!Ctor) {
+        WithColor::error() << toString(Ctor.takeError()) << "\n";
+        return 1;
+    }
+    RegisterRegAlloc::setDefault(*Ctor);
+
+    Expected<TierJIT> Fast = measureFirstExecution(**Input, "fast");
+    if(!Fast) {
+        WithColor::error() << InputFile << ": " << toString(Fast.takeError()) << "\n";
+        return 1;
+    }
+    Expected<TierJIT> Full = measureFirstExecution(**Input, "full");
+    if(!Full) {
+        WithColor::error() << InputFile << ": " << toString(Full.takeError()) << "\n";
+        return 1;
+    }
+
+    /*
+    Tiered run. Calls go through Current, the recompile thread swaps it once its
+    JIT is ready, so the tier-0 code never waits for the full tier. The release
+    store and acquire load order the call after the writes of the finished code.
+    */
+    std::atomic<EntryFn> Current{Fast->Entry};
+    std::optional<Expected<TierJIT>> Recompiled;
+    std::thread Recompile;
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    unsigned TotalCalls = HotCalls + Calls;
+    unsigned SwappedAt = 0;
+    for(unsigned Call = 0; Call < TotalCalls; Call++) {
+        if(Call == HotCalls) {
+            Recompile = std::thread([&]() {
+                Recompiled.emplace(compileTier(**Input, "full"));
+                if(*Recompiled) {
+                    Current.store((*Recompiled)->Entry, std::memory_order_release);
+                }
+            });
+        }
+        EntryFn Entry = Current.load(std::memory_order_acquire);
+        if(!SwappedAt && Entry != Fast->Entry) {
+            SwappedAt = Call;
+        }
+        Entry();
+    }
+    if(Recompile.joinable()) {
+        Recompile.join();
+    }
+    double TieredSeconds = secondsSince(Start);
+    if(Recompiled && !*Recompiled) {
+        WithColor::error() << InputFile << ": " << toString(Recompiled->takeError()) << "\n";
+        return 1;
+    }
+
+    outs() << "tiered " << TotalCalls << " calls in " << format("%.3f ms", TieredSeconds * 1e3) << ", ";
+    if(SwappedAt) {
+        outs() << "swapped to full after " << SwappedAt << " calls\n";
+    } else if(Recompiled) {
+        outs() << "the recompile finished after the last call\n";
+    } else {
+        outs() << "no recompile, -calls is 0\n";
+    }
+
+    double FastPerCall = measureSteadyState(Fast->Entry);
+    double FullPerCall = measureSteadyState(Full->Entry);
+    outs() << format("steady state per call: fast %.2f ns, full %.2f ns\n", FastPerCall * 1e9, FullPerCall * 1e9);
+    return 0;
+}
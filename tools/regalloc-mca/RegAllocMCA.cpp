@@ -0,0 +1,450 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/CodeGen/MachineBlockFrequencyInfo.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/MachineInstrBuilder.h>
+#include <llvm/CodeGen/TargetInstrInfo.h>
+#include <llvm/CodeGen/TargetSubtargetInfo.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/MC/MCAsmInfo.h>
+#include <llvm/MC/MCContext.h>
+#include <llvm/MC/MCInstrAnalysis.h>
+#include <llvm/MC/MCInstrInfo.h>
+#include <llvm/MC/MCObjectFileInfo.h>
+#include <llvm/MC/MCParser/MCAsmLexer.h>
+#include <llvm/MC/MCParser/MCAsmParser.h>
+#include <llvm/MC/MCParser/MCTargetAsmParser.h>
+#include <llvm/MC/MCRegisterInfo.h>
+#include <llvm/MC/MCStreamer.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/MCTargetOptions.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/MCA/Context.h>
+#include <llvm/MCA/CustomBehaviour.h>
+#include <llvm/MCA/InstrBuilder.h>
+#include <llvm/MCA/Pipeline.h>
+#include <llvm/MCA/SourceMgr.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "CodeGenSupport.h"
+
+#include "algorithm"
+#include "cmath"
+#include "map"
+#include "vector"
+
+using namespace llvm;
+
+/*
+regalloc-mca: static throughput estimate of the hottest blocks of a module, as
+allocated by each of several register allocators.
+
+The module is compiled once per allocator. Right before the asm printer, the
+hottest blocks of every function, by MachineBlockFrequencyInfo, are wrapped in
+LLVM-MCA-BEGIN/END region markers. The assembly is then parsed back in process
+and every region is run through the llvm-mca pipeline for the scheduling model
+of the selected CPU, as the body of a loop.
+
+Block frequencies are relative to the entry of their function, scaled by the
+function entry count when the module carries profile data. Without a profile,
+blocks of different functions are ranked by loop nesting only.
+
+    regalloc-mca -mcpu=znver3 -allocators=register-allocator-minimal,greedy kernel.bc
+
+Blocks are matched between allocators by function, IR block and occurrence, so
+blocks created during code generation only match when both pipelines create them.
+*/
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<input bitcode or IR>"));
+
+static cl::opt<std::string> CPU("mcpu", cl::desc("CPU whose scheduling model is used"), cl::init(""));
+
+static cl::opt<std::string> Features("mattr", cl::desc("Target features"), cl::init(""));
+
+// Not -regalloc: the codegen library registers that one already.
+static cl::list<std::string> Allocators("allocators", cl::CommaSeparated,
+                                        cl::desc("Register allocators to compare "
+                                                 "(default: register-allocator-minimal,greedy)"));
+
+static cl::opt<unsigned> BlocksPerFunction("blocks-per-function",
+                                           cl::desc("Hottest blocks of each function to analyze"), cl::init(4));
+
+static cl::opt<unsigned> Top("top", cl::desc("Number of blocks to print"), cl::init(20));
+
+static cl::opt<unsigned> Iterations("iterations", cl::desc("Loop iterations simulated per block"), cl::init(100));
+
+namespace {
+
+// A block wrapped in a region, region names are indices into the HotBlock list of the run.
+struct HotBlock {
+    std::string Key;
+    std::string Function;
+    std::string Label;
+    double Frequency;
+};
+
+// Estimate of one block for each allocator, NaN when it has none
+struct BlockRow {
+    std::string Function;
+    std::string Label;
+    double Frequency = 0;
+    std::vector<double> Cycles;
+};
+
+/*
+Wraps the hottest blocks of each function in llvm-mca region markers.
+
+The markers are comment-only inline assembly, they reach the assembly output
+verbatim when the integrated assembler is disabled. The region ends before the
+first terminator, so the estimate covers the body of the block and not the
+branch back to its header.
+*/
+class HotBlockMarker: public MachineFunctionPass {
+private:
+    std::vector<HotBlock> &Blocks;
+
+public:
+    static char ID;
+
+    HotBlockMarker(std::vector<HotBlock> &Blocks) : MachineFunctionPass(ID), Blocks(Blocks) {}
+
+    StringRef getPassName() const override {
+        return "Hot block llvm-mca markers";
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.setPreservesCFG();
+        AU.addRequired<MachineBlockFrequencyInfoWrapperPass>();
+        MachineFunctionPass::getAnalysisUsage(AU);
+    }
+
+    bool runOnMachineFunction(MachineFunction &MF) override {
+        const MachineBlockFrequencyInfo &MBFI = getAnalysis<MachineBlockFrequencyInfoWrapperPass>().getMBFI();
+        regalloc::BlockKeys Keys(MF);
+
+        std::vector<std::pair<double, HotBlock>> Candidates;
+        std::vector<MachineBasicBlock *> CandidateBlocks;
+        for(MachineBasicBlock &MBB: MF) {
+            bool HasBody = llvm::any_of(MBB, [](const MachineInstr &MI) {
+                return !MI.isMetaInstruction() && !MI.isTerminator();
+            });
+            if(!HasBody) {
+                continue;
+            }
+
+            HotBlock Block;
+            Block.Key = Keys.getKey(MBB);
+            Block.Function = MF.getName().str();
+            Block.Label = regalloc::BlockKeys::getLabel(MBB);
+            Block.Frequency = regalloc::getScaledFrequency(MBFI, MBB);
+            Candidates.push_back({Block.Frequency, std::move(Block)});
+            CandidateBlocks.push_back(&MBB);
+        }
+
+        std::vector<unsigned> Order(Candidates.size());
+        for(unsigned Idx = 0; Idx < Order.size(); Idx++) {
+            Order[Idx] = Idx;
+        }
+        llvm::stable_sort(Order, [&](unsigned A, unsigned B) {
+            return Candidates[A].first > Candidates[B].first;
+        });
+        Order.resize(std::min<size_t>(Order.size(), BlocksPerFunction));
+
+        const TargetInstrInfo *TII = MF.getSubtarget().getInstrInfo();
+        StringRef CommentString = MF.getTarget().getMCAsmInfo()->getCommentString();
+        auto insertMarker = [&](MachineBasicBlock &MBB, MachineBasicBlock::iterator Pos, const Twine &Text) {
+            BuildMI(MBB, Pos, DebugLoc(), TII->get(TargetOpcode::INLINEASM))
+                .addExternalSymbol(MF.createExternalSymbolName((CommentString + " " + Text).str()))
+                .addImm(0);
+        };
+
+        for(unsigned Idx: Order) {
+            MachineBasicBlock &MBB = *CandidateBlocks[Idx];
+            unsigned Region = Blocks.size();
+            Blocks.push_back(std::move(Candidates[Idx].second));
+            insertMarker(MBB, MBB.begin(), "LLVM-MCA-BEGIN " + Twine(Region));
+            insertMarker(MBB, MBB.getFirstTerminator(), "LLVM-MCA-END");
+        }
+        return !Order.empty();
+    }
+};
+
+char HotBlockMarker::ID = 0;
+
+// Collects the instructions between region markers while the assembly is parsed.
+class RegionCollector: public AsmCommentConsumer {
+private:
+    std::map<unsigned, std::vector<MCInst>> &Regions;
+    std::vector<MCInst> *Current = nullptr;
+
+public:
+    RegionCollector(std::map<unsigned, std::vector<MCInst>> &Regions) : Regions(Regions) {}
+
+    void HandleComment(SMLoc Loc, StringRef CommentText) override {
+        StringRef Comment = CommentText.trim();
+        if(Comment.consume_front("LLVM-MCA-END")) {
+            Current = nullptr;
+            return;
+        }
+        unsigned Region;
+        if(!Comment.consume_front("LLVM-MCA-BEGIN") || Comment.trim().getAsInteger(10, Region)) {
+            return;
+        }
+        Current = &Regions[Region];
+    }
+
+    void addInstruction(const MCInst &Inst) {
+        if(Current) {
+            Current->push_back(Inst);
+        }
+    }
+};
+
+// Streamer that only keeps instructions, same as the one of llvm-mca.
+class InstructionCollector final: public MCStreamer {
+private:
+    RegionCollector &Collector;
+
+public:
+    InstructionCollector(MCContext &Context, RegionCollector &Collector) : MCStreamer(Context), Collector(Collector) {}
+
+    void emitInstruction(const MCInst &Inst, const MCSubtargetInfo &STI) override {
+        Collector.addInstruction(Inst);
+    }
+
+    bool emitSymbolAttribute(MCSymbol *Symbol, MCSymbolAttr Attribute) override {
+        return true;
+    }
+
+    void emitCommonSymbol(MCSymbol *Symbol, uint64_t Size, Align ByteAlignment) override {}
+
+    void emitZerofill(MCSection *Section, MCSymbol *Symbol = nullptr, uint64_t Size = 0,
+                      Align ByteAlignment = Align(1), SMLoc Loc = SMLoc()) override {}
+
+    void emitGPRel32Value(const MCExpr *Value) override {}
+
+    void beginCOFFSymbolDef(const MCSymbol *Symbol) override {}
+
+    void emitCOFFSymbolStorageClass(int StorageClass) override {}
+
+    void emitCOFFSymbolType(int Type) override {}
+
+    void endCOFFSymbolDef() override {}
+};
+
+/*
+Parse the assembly of one compile and estimate the cycles per iteration of each
+region. The MC objects must outlive the simulation, parsed instructions refer to
+expressions owned by the MCContext.
+*/
+Error estimateRegions(StringRef Assembly, const Triple &TheTriple, std::map<unsigned, double> &Cycles) {
+    std::string Error;
+    const Target *TheTarget = TargetRegistry::lookupTarget(TheTriple.getTriple(), Error);
+    if(!TheTarget) {
+        return createStringError(inconvertibleErrorCode(), Error);
+    }
+
+    MCTargetOptions MCOptions;
+    std::unique_ptr<MCRegisterInfo> MRI(TheTarget->createMCRegInfo(TheTriple.getTriple()));
+    std::unique_ptr<MCAsmInfo> MAI(TheTarget->createMCAsmInfo(*MRI, TheTriple.getTriple(), MCOptions));
+    std::unique_ptr<MCSubtargetInfo> STI(TheTarget->createMCSubtargetInfo(TheTriple.getTriple(), CPU, Features));
+    std::unique_ptr<MCInstrInfo> MCII(TheTarget->createMCInstrInfo());
+    std::unique_ptr<MCInstrAnalysis> MCIA(TheTarget->createMCInstrAnalysis(MCII.get()));
+    if(!STI->getSchedModel().hasInstrSchedModel()) {
+        return createStringError(inconvertibleErrorCode(), "CPU '%s' has no scheduling model, select one with -mcpu",
+                                 CPU.c_str());
+    }
+
+    SourceMgr SrcMgr;
+    SrcMgr.AddNewSourceBuffer(MemoryBuffer::getMemBufferCopy(Assembly, "<codegen output>"), SMLoc());
+    MCContext Ctx(TheTriple, MAI.get(), MRI.get(), STI.get(), &SrcMgr);
+    std::unique_ptr<MCObjectFileInfo> MOFI(TheTarget->createMCObjectFileInfo(Ctx, /*PIC=*/false));
+    Ctx.setObjectFileInfo(MOFI.get());
+
+    std::map<unsigned, std::vector<MCInst>> Regions;
+    RegionCollector Collector(Regions);
+    InstructionCollector Streamer(Ctx, Collector);
+    std::unique_ptr<MCAsmParser> Parser(createMCAsmParser(SrcMgr, Ctx, Streamer, *MAI));
+    Parser->getLexer().setCommentConsumer(&Collector);
+    std::unique_ptr<MCTargetAsmParser> TAP(TheTarget->createMCAsmParser(*STI, *Parser, *MCII, MCOptions));
+    if(!TAP) {
+        return createStringError(inconvertibleErrorCode(), "the target has no assembly parser");
+    }
+    Parser->setTargetParser(*TAP);
+    if(Parser->Run(/*NoInitialTextSection=*/false)) {
+        return createStringError(inconvertibleErrorCode(), "could not parse the generated assembly");
+    }
+
+    std::unique_ptr<mca::InstrumentManager> IM(TheTarget->createInstrumentManager(*STI, *MCII));
+    if(!IM) {
+        IM = std::make_unique<mca::InstrumentManager>(*STI, *MCII);
+    }
+    std::unique_ptr<mca::InstrPostProcess> IPP(TheTarget->createInstrPostProcess(*STI, *MCII));
+    if(!IPP) {
+        IPP = std::make_unique<mca::InstrPostProcess>(*STI, *MCII);
+    }
+    mca::InstrBuilder IB(*STI, *MCII, *MRI, MCIA.get(), *IM, /*CallLatency=*/100);
+    mca::Context MCA(*MRI, *STI);
+    mca::PipelineOptions Options(/*UOPQSize=*/0, /*DecThr=*/0, /*DW=*/0, /*RFS=*/0, /*LQS=*/0, /*SQS=*/0,
+                                 /*NoAlias=*/true);
+
+    for(auto &[Region, Insts]: Regions) {
+        IB.clear();
+        IPP->resetState();
+
+        SmallVector<mca::Instrument *> Instruments;
+        SmallVector<std::unique_ptr<mca::Instruction>> Lowered;
+        bool Supported = !Insts.empty();
+        for(const MCInst &MCI: Insts) {
+            Expected<std::unique_ptr<mca::Instruction>> Inst = IB.createInstruction(MCI, Instruments);
+            if(!Inst) {
+                // Instructions without a scheduling class leave the block without an estimate.
+                consumeError(Inst.takeError());
+                Supported = false;
+                break;
+            }
+            IPP->postProcessInstruction(*Inst, MCI);
+            Lowered.push_back(std::move(*Inst));
+        }
+        if(!Supported) {
+            continue;
+        }
+
+        mca::CircularSourceMgr Source(Lowered, Iterations);
+        std::unique_ptr<mca::CustomBehaviour> CB(TheTarget->createCustomBehaviour(*STI, Source, *MCII));
+        if(!CB) {
+            CB = std::make_unique<mca::CustomBehaviour>(*STI, Source, *MCII);
+        }
+        std::unique_ptr<mca::Pipeline> Pipeline = MCA.createDefaultPipeline(Options, Source, *CB);
+        Expected<unsigned> TotalCycles = Pipeline->run();
+        if(!TotalCycles) {
+            return TotalCycles.takeError();
+        }
+        Cycles[Region] = double(*TotalCycles) / Iterations;
+    }
+    return Error::success();
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    regalloc::initializeLLVM();
+    cl::ParseCommandLineOptions(argc, argv, "Estimate hot block throughput per register allocator\n");
+
+    std::vector<std::string> Names(Allocators.begin(), Allocators.end());
+    if(Names.empty()) {
+        Names = {"register-allocator-minimal", "greedy"};
+    }
+    for(const std::string &Name: Names) {
+        Expected<RegisterRegAlloc::FunctionPassCtor> Ctor = regalloc::lookupRegisterAllocator(Name);
+        if(!Ctor) {
+            WithColor::error() << toString(Ctor.takeError()) << "\n";
+            return 1;
+        }
+    }
+    if(Iterations == 0) {
+        WithColor::error() << "-iterations must be at least 1\n";
+        return 1;
+    }
+
+    LLVMContext Context;
+    Expected<std::unique_ptr<Module>> M = regalloc::loadModule(InputFile, Context);
+    if(!M) {
+        WithColor::error() << InputFile << ": " << toString(M.takeError()) << "\n";
+        return 1;
+    }
+    Expected<std::unique_ptr<TargetMachine>> TM = regalloc::createTargetMachine(**M, CPU, Features,
+                                                                                /*DisableIntegratedAS=*/true);
+    if(!TM) {
+        WithColor::error() << toString(TM.takeError()) << "\n";
+        return 1;
+    }
+
+    // Rows in the order blocks are first seen, so equal frequencies keep module order.
+    StringMap<unsigned> RowIndex;
+    std::vector<BlockRow> Rows;
+    for(unsigned Alloc = 0; Alloc < Names.size(); Alloc++) {
+        // Code generation rewrites the IR, every allocator starts from a fresh copy.
+        std::unique_ptr<Module> Clone = CloneModule(**M);
+        std::vector<HotBlock> Blocks;
+        SmallString<0> Assembly;
+        raw_svector_ostream OS(Assembly);
+        if(Error E = regalloc::runCodeGen(*Clone, **TM, Names[Alloc], {new HotBlockMarker(Blocks)}, OS,
+                                          CodeGenFileType::AssemblyFile)) {
+            WithColor::error() << Names[Alloc] << ": " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+
+        std::map<unsigned, double> Cycles;
+        if(Error E = estimateRegions(Assembly, (*TM)->getTargetTriple(), Cycles)) {
+            WithColor::error() << Names[Alloc] << ": " << toString(std::move(E)) << "\n";
+            return 1;
+        }
+
+        for(unsigned Region = 0; Region < Blocks.size(); Region++) {
+            const HotBlock &Block = Blocks[Region];
+            auto [It, Inserted] = RowIndex.try_emplace(Block.Key, Rows.size());
+            if(Inserted) {
+                BlockRow Row;
+                Row.Function = Block.Function;
+                Row.Label = Block.Label;
+                Row.Frequency = Block.Frequency;
+                Row.Cycles.assign(Names.size(), NAN);
+                Rows.push_back(std::move(Row));
+            }
+            auto Estimate = Cycles.find(Region);
+            if(Estimate != Cycles.end()) {
+                Rows[It->second].Cycles[Alloc] = Estimate->second;
+            }
+        }
+    }
+
+    size_t NumPrinted = std::min<size_t>(Top, Rows.size());
+    std::stable_sort(Rows.begin(), Rows.end(), [](const BlockRow &A, const BlockRow &B) {
+        return A.Frequency > B.Frequency;
+    });
+
+    outs() << "Estimated cycles per iteration, " << (*TM)->getTargetTriple().str() << " "
+           << (CPU.empty() ? (*TM)->getTargetCPU().str() : CPU) << "\n\n";
+    outs() << "frequency   ";
+    for(const std::string &Name: Names) {
+        outs() << format(" %-14s", Name.substr(0, 14).c_str());
+    }
+    outs() << " block\n";
+
+    // Frequency weighted totals over the blocks every allocator has an estimate for
+    std::vector<double> Totals(Names.size(), 0);
+    for(const BlockRow &Row: ArrayRef<BlockRow>(Rows).take_front(NumPrinted)) {
+        outs() << format("%-12.4g", Row.Frequency);
+        for(double Cycles: Row.Cycles) {
+            if(std::isnan(Cycles)) {
+                outs() << " -             ";
+            } else {
+                outs() << format(" %-14.2f", Cycles);
+            }
+        }
+        outs() << " " << Row.Function << ":" << Row.Label << "\n";
+
+        if(llvm::none_of(Row.Cycles, [](double Cycles) { return std::isnan(Cycles); })) {
+            for(unsigned Alloc = 0; Alloc < Names.size(); Alloc++) {
+                Totals[Alloc] += Row.Frequency * Row.Cycles[Alloc];
+            }
+        }
+    }
+
+    outs() << "\nfrequency weighted cycles:\n";
+    for(unsigned Alloc = 0; Alloc < Names.size(); Alloc++) {
+        outs() << format("    %-28s %.2f\n", Names[Alloc].c_str(), Totals[Alloc]);
+    }
+    return 0;
+}
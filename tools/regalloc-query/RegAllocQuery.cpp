@@ -0,0 +1,215 @@
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "IntervalDump.h"
+
+#include "algorithm"
+#include "memory"
+#include "vector"
+
+using namespace llvm;
+
+/*
+regalloc-query: queries over the interval dumps written by the Minimal Register
+Allocator with -regalloc-minimal-dump-dir.
+
+The dump files are memory mapped and read in place, so a module with millions of
+intervals is answered in seconds.
+
+Top 20 spilled intervals across the module, by frequency weighted reload count:
+
+    regalloc-query --filter=spilled --sort=reloads --top=20 dumps/
+*/
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+                                    cl::desc("<dump files or directories>"));
+
+enum class SortKey { Reloads, Weight, Dequeues, Length };
+
+static cl::opt<SortKey> Sort(
+    "sort", cl::desc("Rank intervals by"), cl::init(SortKey::Reloads),
+    cl::values(clEnumValN(SortKey::Reloads, "reloads", "Block frequency weighted reload count"),
+               clEnumValN(SortKey::Weight, "weight", "Spill weight"),
+               clEnumValN(SortKey::Dequeues, "dequeues", "Number of times the register was dequeued"),
+               clEnumValN(SortKey::Length, "length", "Live length in instructions")));
+
+enum class RowFilter { All, Spilled, Assigned, Evicted, Split };
+
+static cl::opt<RowFilter> Filter(
+    "filter", cl::desc("Only consider intervals that were"), cl::init(RowFilter::All),
+    cl::values(clEnumValN(RowFilter::All, "all", "Any interval"),
+               clEnumValN(RowFilter::Spilled, "spilled", "Spilled"),
+               clEnumValN(RowFilter::Assigned, "assigned", "Assigned a register"),
+               clEnumValN(RowFilter::Evicted, "evicted", "Evicted by another interval"),
+               clEnumValN(RowFilter::Split, "split", "Created by splitting or spilling")));
+
+static cl::opt<unsigned> Top("top", cl::desc("Number of intervals to print"), cl::init(20));
+
+static cl::opt<std::string> FunctionFilter("function", cl::desc("Only consider this function"), cl::init(""));
+
+namespace {
+
+// A mapped dump file
+struct DumpFile {
+    std::unique_ptr<MemoryBuffer> Buffer;
+    IntervalDump::FileView View;
+};
+
+// One interval of one dump file, with its sort key
+struct RowRef {
+    const DumpFile *File;
+    uint32_t FileIdx;
+    uint32_t Row;
+    double Key;
+};
+
+uint64_t getLiveLength(const IntervalDump::FileView &View, uint32_t Row) {
+    const IntervalDump::Segment *Segments = View.segments() + View.get(IntervalDump::SegmentBegin, Row);
+    uint64_t Length = 0;
+    for(uint32_t Seg = 0; Seg < View.get(IntervalDump::SegmentCount, Row); Seg++) {
+        Length += Segments[Seg].End - Segments[Seg].Start;
+    }
+    return Length / IntervalDump::SlotsPerInstruction;
+}
+
+bool matchesFilter(const IntervalDump::FileView &View, uint32_t Row) {
+    uint32_t History = View.get(IntervalDump::History, Row);
+    switch(Filter) {
+        case RowFilter::All:
+        return true;
+        case RowFilter::Spilled:
+        return History & IntervalDump::Spilled;
+        case RowFilter::Assigned:
+        return History & IntervalDump::Assigned;
+        case RowFilter::Evicted:
+        return History & IntervalDump::Evicted;
+        case RowFilter::Split:
+        return History & IntervalDump::SplitProduct;
+    }
+    return false;
+}
+
+double getSortKey(const IntervalDump::FileView &View, uint32_t Row) {
+    switch(Sort) {
+        case SortKey::Reloads:
+        return View.getFloat(IntervalDump::WeightedReloads, Row);
+        case SortKey::Weight:
+        return View.getFloat(IntervalDump::Weight, Row);
+        case SortKey::Dequeues:
+        return View.get(IntervalDump::Dequeues, Row);
+        case SortKey::Length:
+        return getLiveLength(View, Row);
+    }
+    return 0;
+}
+
+// Expand directories into the .rai files below them.
+void collectDumpFiles(StringRef Input, std::vector<std::string> &Files) {
+    if(!sys::fs::is_directory(Input)) {
+        Files.push_back(Input.str());
+        return;
+    }
+
+    std::error_code EC;
+    for(sys::fs::recursive_directory_iterator It(Input, EC), End; It != End && !EC; It.increment(EC)) {
+        if(sys::path::extension(It->path()) == ".rai") {
+            Files.push_back(It->path());
+        }
+    }
+    if(EC) {
+        WithColor::error() << Input << ": " << EC.message() << "\n";
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Query interval dumps of the Minimal Register Allocator\n");
+
+    std::vector<std::string> Files;
+    for(const std::string &Input: Inputs) {
+        collectDumpFiles(Input, Files);
+    }
+    llvm::sort(Files);
+
+    std::vector<std::unique_ptr<DumpFile>> Dumps;
+    for(const std::string &File: Files) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(
+            File, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if(!Buffer) {
+            WithColor::error() << File << ": " << Buffer.getError().message() << "\n";
+            return 1;
+        }
+
+        Expected<IntervalDump::FileView> View = IntervalDump::FileView::create((*Buffer)->getMemBufferRef());
+        if(!View) {
+            WithColor::error() << toString(View.takeError()) << "\n";
+            return 1;
+        }
+        Dumps.push_back(std::make_unique<DumpFile>(DumpFile{std::move(*Buffer), *View}));
+    }
+
+    uint64_t NumRows = 0;
+    std::vector<RowRef> Matches;
+    for(uint32_t FileIdx = 0; FileIdx < Dumps.size(); FileIdx++) {
+        const DumpFile *Dump = Dumps[FileIdx].get();
+        const IntervalDump::FileView &View = Dump->View;
+        if(!FunctionFilter.empty() && View.getFunctionName() != FunctionFilter) {
+            continue;
+        }
+
+        NumRows += View.getNumRows();
+        for(uint32_t Row = 0; Row < View.getNumRows(); Row++) {
+            if(matchesFilter(View, Row)) {
+                Matches.push_back({Dump, FileIdx, Row, getSortKey(View, Row)});
+            }
+        }
+    }
+
+    // Highest key first; file order and row break ties so the output is stable.
+    size_t NumPrinted = std::min<size_t>(Top, Matches.size());
+    std::partial_sort(Matches.begin(), Matches.begin() + NumPrinted, Matches.end(),
+                      [](const RowRef &A, const RowRef &B) {
+                          if(A.Key != B.Key) {
+                              return A.Key > B.Key;
+                          }
+                          return std::make_pair(A.FileIdx, A.Row) < std::make_pair(B.FileIdx, B.Row);
+                      });
+
+    outs() << Dumps.size() << " functions, " << NumRows << " intervals, " << Matches.size() << " matching\n\n";
+    outs() << "reloads      weight       dequeues  length    class            assigned   vreg     function\n";
+    for(const RowRef &Ref: ArrayRef<RowRef>(Matches).take_front(NumPrinted)) {
+        const IntervalDump::FileView &View = Ref.File->View;
+        uint32_t Row = Ref.Row;
+
+        std::string Assignment = View.getString(View.get(IntervalDump::PhysRegName, Row)).str();
+        int32_t Slot = int32_t(View.get(IntervalDump::StackSlot, Row));
+        if(Assignment.empty() && Slot >= 0) {
+            Assignment = "fi#" + std::to_string(Slot);
+        }
+        if(Assignment.empty()) {
+            Assignment = "-";
+        }
+
+        outs() << format("%-12.2f %-12.4g %-9u %-9llu %-16s %-10s %%%-7u %s\n",
+                         View.getFloat(IntervalDump::WeightedReloads, Row),
+                         View.getFloat(IntervalDump::Weight, Row),
+                         View.get(IntervalDump::Dequeues, Row),
+                         (unsigned long long)getLiveLength(View, Row),
+                         View.getString(View.get(IntervalDump::RegClassName, Row)).str().c_str(),
+                         Assignment.c_str(),
+                         View.get(IntervalDump::VirtReg, Row),
+                         View.getFunctionName().str().c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "CodeGenSupport.h"
+
+#include "algorithm"
+#include "atomic"
+#include "string"
+#include "thread"
+#include "vector"
+
+using namespace llvm;
+
+/*
+regalloc-stress: compile one module many times at once and check that every
+compile produced the same bytes.
+
+Allocator instances must not share mutable state: parallel codegen and ThinLTO
+backends run one pass pipeline per thread, all in the same process. Each run
+parses the module into its own LLVMContext and compiles it with the target
+machine of its thread, -runs times over -j threads. Any output that differs from
+the first successful run, and any run that fails, is reported and makes the tool
+exit with 1.
+
+    regalloc-stress -j 16 -runs 256 kernel.bc
+
+Run it under ThreadSanitizer to catch races that happen not to change the
+output. Allocator options, such as -regalloc-minimal-trace, apply to every run.
+*/
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required, cl::desc("<input bitcode or IR>"));
+
+static cl::opt<unsigned> Threads("j", cl::desc("Codegen threads, 0 for one per core"), cl::init(0));
+
+static cl::opt<unsigned> Runs("runs", cl::desc("Compiles of the module, 0 for four per thread"), cl::init(0));
+
+// Not -regalloc: the codegen library registers that one already.
+static cl::opt<std::string> Allocator("allocator", cl::desc("Register allocator"),
+                                      cl::init("register-allocator-minimal"));
+
+static cl::opt<std::string> CPU("mcpu", cl::desc("Target CPU"), cl::init(""));
+
+static cl::opt<std::string> Features("mattr", cl::desc("Target features"), cl::init(""));
+
+static cl::opt<CodeGenFileType> FileType(
+    "filetype", cl::desc("Type of the compared output"), cl::init(CodeGenFileType::ObjectFile),
+    cl::values(clEnumValN(CodeGenFileType::AssemblyFile, "asm", "Assembly"),
+               clEnumValN(CodeGenFileType::ObjectFile, "obj", "Object file")));
+
+namespace {
+
+struct RunOutput {
+    SmallVector<char, 0> Code;
+    std::string Error;
+};
+
+void runWorker(const MemoryBuffer &Input, std::atomic<unsigned> &NextRun, std::vector<RunOutput> &Outputs) {
+    // One per thread, like the codegen threads of a ThinLTO backend.
+    std::unique_ptr<TargetMachine> TM;
+    for(unsigned Run = NextRun++; Run < Outputs.size(); Run = NextRun++) {
+        RunOutput &Output = Outputs[Run];
+        LLVMContext Context;
+        SMDiagnostic Diag;
+        std::unique_ptr<Module> M = parseIR(Input.getMemBufferRef(), Diag, Context);
+        if(!M) {
+            raw_string_ostream OS(Output.Error);
+            Diag.print("", OS, /*ShowColors=*/false);
+            continue;
+        }
+
+        Error E = Error::success();
+        if(!TM) {
+            Expected<std::unique_ptr<TargetMachine>> Created = regalloc::createTargetMachine(*M, CPU, Features);
+            if(Created) {
+                TM = std::move(*Created);
+            } else {
+                E = Created.takeError();
+            }
+        } else {
+            M->setTargetTriple(TM->getTargetTriple().str());
+            M->setDataLayout(TM->createDataLayout());
+        }
+        if(!E) {
+            raw_svector_ostream OS(Output.Code);
+            E = regalloc::runCodeGen(*M, *TM, Allocator, {}, OS, FileType);
+        }
+        if(E) {
+            Output.Error = toString(std::move(E));
+        }
+    }
+}
+
+// Offset of the first byte where A and B differ
+size_t getFirstDifference(ArrayRef<char> A, ArrayRef<char> B) {
+    size_t Length = std::min(A.size(), B.size());
+    return std::mismatch(A.begin(), A.begin() + Length, B.begin()).first - A.begin();
+}
+
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    regalloc::initializeLLVM();
+    cl::ParseCommandLineOptions(argc, argv, "Concurrent determinism check of a register allocator\n");
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Input = MemoryBuffer::getFileOrSTDIN(InputFile);
+    if(!Input) {
+        WithColor::error() << InputFile << ": " << Input.getError().message() << "\n";
+        return 1;
+    }
+
+    // Threads only read the allocator default, set it before they start.
+    Expected<RegisterRegAlloc::FunctionPassCtor> Ctor = regalloc::lookupRegisterAllocator(Allocator);
+    if(!Ctor) {
+        WithColor::error() << toString(Ctor.takeError()) << "\n";
+        return 1;
+    }
+    RegisterRegAlloc::setDefault(*Ctor);
+
+    unsigned NumThreads = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+    unsigned NumRuns = Runs ? Runs : 4 * NumThreads;
+    NumThreads = std::min(NumThreads, NumRuns);
+
+    std::vector<RunOutput> Outputs(NumRuns);
+    std::atomic<unsigned> NextRun{0};
+    std::vector<std::thread> Workers;
+    for(unsigned Thread = 0; Thread < NumThreads; Thread++) {
+        Workers.emplace_back(runWorker, std::cref(**Input), std::ref(NextRun), std::ref(Outputs));
+    }
+    for(std::thread &Worker: Workers) {
+        Worker.join();
+    }
+
+    // The reference is the first run that succeeded.
+    unsigned Failed = 0;
+    unsigned Differing = 0;
+    const RunOutput *Reference = nullptr;
+    for(unsigned Run = 0; Run < NumRuns; Run++) {
+        const RunOutput &Output = Outputs[Run];
+        if(!Output.Error.empty()) {
+            WithColor::error() << "run " << Run << ": " << Output.Error << "\n";
+            Failed++;
+            continue;
+        }
+        if(!Reference) {
+            Reference = &Output;
+            continue;
+        }
+        if(Output.Code != Reference->Code) {
+            WithColor::error() << "run " << Run << ": " << Output.Code.size() << " bytes, differs from the first "
+                               << "successful run (" << Reference->Code.size() << " bytes) at offset "
+                               << getFirstDifference(Output.Code, Reference->Code) << "\n";
+            Differing++;
+        }
+    }
+
+    outs() << NumRuns << " runs on " << NumThreads << " threads: " << (NumRuns - Failed - Differing)
+           << " identical, " << Differing << " differing, " << Failed << " failed\n";
+    return Failed || Differing ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/CodeGen/MachineBlockFrequencyInfo.h>
+#include <llvm/CodeGen/MachineFunction.h>
+#include <llvm/CodeGen/MachineModuleInfo.h>
+#include <llvm/CodeGen/Passes.h>
+#include <llvm/CodeGen/TargetPassConfig.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/InitializePasses.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/PassRegistry.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/Triple.h>
+
+#include "CodeGenSupport.h"
+#include "RegisterAllocator.h"
+
+#include "algorithm"
+#include "optional"
+
+using namespace llvm;
+
+void regalloc::initializeLLVM() {
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+    InitializeAllAsmParsers();
+    InitializeAllTargetMCAs();
+
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeCodeGen(Registry);
+    initializeLoopStrengthReducePass(Registry);
+    initializeLowerIntrinsicsPass(Registry);
+    initializeTarget(Registry);
+}
+
+Expected<std::unique_ptr<Module>> regalloc::loadModule(StringRef Path, LLVMContext &Context) {
+    SMDiagnostic Diag;
+    std::unique_ptr<Module> M = parseIRFile(Path, Diag, Context);
+    if(!M) {
+        std::string Message;
+        raw_string_ostream OS(Message);
+        Diag.print("", OS, /*ShowColors=*/false);
+        return createStringError(inconvertibleErrorCode(), OS.str());
+    }
+    return std::move(M);
+}
+
+Expected<std::unique_ptr<TargetMachine>> regalloc::createTargetMachine(Module &M, StringRef CPU, StringRef Features,
+                                                                       bool DisableIntegratedAS) {
+    std::string TripleName = M.getTargetTriple();
+    if(TripleName.empty()) {
+        TripleName = sys::getDefaultTargetTriple();
+        M.setTargetTriple(TripleName);
+    }
+
+    std::string Error;
+    const Target *TheTarget = TargetRegistry::lookupTarget(TripleName, Error);
+    if(!TheTarget) {
+        return createStringError(inconvertibleErrorCode(), Error);
+    }
+
+    TargetOptions Options;
+    Options.DisableIntegratedAS = DisableIntegratedAS;
+    std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+        TripleName, CPU, Features, Options, std::nullopt, std::nullopt, CodeGenOptLevel::Default));
+    if(!TM) {
+        return createStringError(inconvertibleErrorCode(), "could not allocate a target machine for %s",
+                                 TripleName.c_str());
+    }
+
+    M.setDataLayout(TM->createDataLayout());
+    return std::move(TM);
+}
+
+Expected<RegisterRegAlloc::FunctionPassCtor> regalloc::lookupRegisterAllocator(StringRef Name) {
+    // Keep the allocator library linked in, its registration is a static constructor.
+    if(Name == "register-allocator-minimal") {
+        return RegisterRegAlloc::FunctionPassCtor([]() { return createRegisterAllocatorMinimal(); });
+    }
+
+    for(RegisterRegAlloc *Node = RegisterRegAlloc::getList(); Node; Node = Node->getNext()) {
+        if(Node->getName() == Name) {
+            return Node->getCtor();
+        }
+    }
+    return createStringError(inconvertibleErrorCode(), "unknown register allocator '%s'", Name.str().c_str());
+}
+
+Error regalloc::runCodeGen(Module &M, TargetMachine &TM, StringRef RegAlloc, ArrayRef<Pass *> PostRAPasses,
+                           raw_pwrite_stream &Out, CodeGenFileType FileType) {
+    Expected<RegisterRegAlloc::FunctionPassCtor> Ctor = lookupRegisterAllocator(RegAlloc);
+    if(!Ctor) {
+        for(Pass *P: PostRAPasses) {
+            delete P;
+        }
+        return Ctor.takeError();
+    }
+    // TargetPassConfig asks the registry default before falling back to the target's choice.
+    if(RegisterRegAlloc::getDefault() != *Ctor) {
+        RegisterRegAlloc::setDefault(*Ctor);
+    }
+
+    /*
+    Same pipeline as LLVMTargetMachine::addPassesToEmitFile, split open so the
+    extra passes go between the machine passes and the asm printer.
+    */
+    LLVMTargetMachine &LTM = static_cast<LLVMTargetMachine &>(TM);
+    legacy::PassManager PM;
+    TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+    PM.add(new TargetLibraryInfoWrapperPass(TLII));
+
+    auto *MMIWP = new MachineModuleInfoWrapperPass(&LTM);
+    TargetPassConfig *PassConfig = LTM.createPassConfig(PM);
+    PM.add(PassConfig);
+    PM.add(MMIWP);
+    if(PassConfig->addISelPasses()) {
+        for(Pass *P: PostRAPasses) {
+            delete P;
+        }
+        return createStringError(inconvertibleErrorCode(), "instruction selection could not be set up");
+    }
+    PassConfig->addMachinePasses();
+    PassConfig->setInitialized();
+
+    for(Pass *P: PostRAPasses) {
+        PM.add(P);
+    }
+
+    if(LTM.addAsmPrinter(PM, Out, nullptr, FileType, MMIWP->getMMI().getContext())) {
+        return createStringError(inconvertibleErrorCode(), "the target does not support this output file type");
+    }
+    PM.add(createFreeMachineFunctionPass());
+
+    PM.run(M);
+    return Error::success();
+}
+
+regalloc::BlockKeys::BlockKeys(const MachineFunction &MF) {
+    const Function &F = MF.getFunction();
+    DenseMap<const BasicBlock *, unsigned> IRIndex;
+    for(const BasicBlock &BB: F) {
+        IRIndex.try_emplace(&BB, IRIndex.size());
+    }
+
+    DenseMap<const BasicBlock *, unsigned> Occurrences;
+    for(const MachineBasicBlock &MBB: MF) {
+        const BasicBlock *BB = MBB.getBasicBlock();
+        unsigned Occurrence = Occurrences[BB]++;
+        Keys[&MBB] = F.getName().str() + "/" + (BB ? std::to_string(IRIndex.lookup(BB)) : std::string("-")) + "."
+                     + std::to_string(Occurrence);
+    }
+}
+
+const std::string &regalloc::BlockKeys::getKey(const MachineBasicBlock &MBB) const {
+    return Keys.find(&MBB)->second;
+}
+
+std::string regalloc::BlockKeys::getLabel(const MachineBasicBlock &MBB) {
+    if(MBB.getBasicBlock() && MBB.getBasicBlock()->hasName()) {
+        return MBB.getBasicBlock()->getName().str();
+    }
+    return "bb." + std::to_string(MBB.getNumber());
+}
+
+double regalloc::getScaledFrequency(const MachineBlockFrequencyInfo &MBFI, const MachineBasicBlock &MBB) {
+    double Scale = 1;
+    if(std::optional<Function::ProfileCount> Count = MBB.getParent()->getFunction().getEntryCount()) {
+        Scale = std::max<double>(Count->getCount(), 1);
+    }
+    return MBFI.getBlockFreqRelativeToEntryBlock(&MBB) * Scale;
+}
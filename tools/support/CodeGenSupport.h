@@ -0,0 +1,93 @@
+#ifndef REGISTER_ALLOCATOR_MINIMAL_CODEGEN_SUPPORT_H
+#define REGISTER_ALLOCATOR_MINIMAL_CODEGEN_SUPPORT_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/CodeGen/RegAllocRegistry.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/Error.h>
+
+#include "memory"
+#include "string"
+
+/*
+Code generation helpers shared by the allocator tools.
+
+The tools compile the same module once per register allocator and look at the
+machine code each allocator produced, so they need a codegen pipeline where the
+allocator is picked by name and where extra passes can run on the final machine
+code, right before it is printed.
+*/
+namespace llvm {
+
+class LLVMContext;
+class MachineBasicBlock;
+class MachineBlockFrequencyInfo;
+class MachineFunction;
+class Module;
+class Pass;
+class TargetMachine;
+class raw_pwrite_stream;
+
+namespace regalloc {
+
+// Register all targets, their MC layers and the codegen passes.
+void initializeLLVM();
+
+// Parse a bitcode or textual IR file.
+Expected<std::unique_ptr<Module>> loadModule(StringRef Path, LLVMContext &Context);
+
+/*
+Create a target machine for the triple of M, or for the host when M has none,
+and set the data layout of M to match. DisableIntegratedAS makes inline assembly
+reach the assembly output verbatim, comments included.
+*/
+Expected<std::unique_ptr<TargetMachine>> createTargetMachine(Module &M, StringRef CPU, StringRef Features,
+                                                             bool DisableIntegratedAS = false);
+
+// Find a register allocator registered with RegisterRegAlloc, e.g. "greedy".
+Expected<RegisterRegAlloc::FunctionPassCtor> lookupRegisterAllocator(StringRef Name);
+
+/*
+Run the codegen pipeline of TM on M with the named register allocator.
+
+PostRAPasses run after the last machine pass, right before the asm printer, and
+are owned by the pass manager afterwards. The allocator is selected through the
+process wide RegisterRegAlloc default, so two pipelines with different
+allocators must not run at the same time. Concurrent pipelines with the same
+allocator are fine once the default was set, e.g. by a first lookup and
+setDefault before the threads start.
+*/
+Error runCodeGen(Module &M, TargetMachine &TM, StringRef RegAlloc, ArrayRef<Pass *> PostRAPasses,
+                 raw_pwrite_stream &Out, CodeGenFileType FileType);
+
+/*
+Names of the machine blocks of a function that are the same in every pipeline
+compiling the same IR: function, position of the IR block and occurrence of the
+IR block in layout order. Blocks created during code generation only get the
+same key when both pipelines create them.
+*/
+class BlockKeys {
+private:
+    DenseMap<const MachineBasicBlock *, std::string> Keys;
+
+public:
+    explicit BlockKeys(const MachineFunction &MF);
+
+    const std::string &getKey(const MachineBasicBlock &MBB) const;
+
+    // IR name of the block, or its machine block number
+    static std::string getLabel(const MachineBasicBlock &MBB);
+};
+
+/*
+Frequency of MBB relative to the entry of its function, scaled by the function
+entry count when there is profile data, so blocks of different functions compare.
+*/
+double getScaledFrequency(const MachineBlockFrequencyInfo &MBFI, const MachineBasicBlock &MBB);
+
+}
+}
+
+#endif